@@ -0,0 +1,269 @@
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+#define RING_SIZE 1024          // Tasks queued at most; a power of two
+#define MAX_WORKERS 256
+#define SPINS 1000              // Polls of the ring before sleeping
+#define CHECK_NS 100000000      // Parent sleeps this long before looking for dead workers
+
+// One task. seq tells whose turn the slot is: the producer's for task pos
+// when it equals pos, the consumers' when it equals pos + 1.
+typedef struct {
+    atomic_ulong seq;
+    pool_task_t fn;
+    long arg;
+} __attribute__((aligned(64))) slot_t;
+
+// Header of the shared mapping; the ring and the result area follow it
+typedef struct {
+    // Written by the parent
+    _Alignas(64) atomic_ulong tail;     // Next task to queue
+    atomic_uint posted;                 // Futex word: bumped at each submit
+    atomic_int stop;
+    // Taken by the workers
+    _Alignas(64) atomic_ulong head;     // Next task to run
+    atomic_int sleepers;                // Workers waiting on posted
+    // Bumped by the workers, waited on by the parent
+    _Alignas(64) atomic_uint completed; // Futex word
+    atomic_int parent_waiting;
+    slot_t ring[RING_SIZE];
+} shared_t;
+
+struct pool {
+    shared_t *sh;
+    void *area;
+    size_t map_size;
+    unsigned int submitted;
+    int workers;
+    int dead;                   // Workers found exited before pool_destroy()
+    pid_t pids[MAX_WORKERS];    // 0 once reaped
+};
+
+// The mapping is shared between processes, so the futexes cannot be private.
+// Returns -1 with errno ETIMEDOUT once /timeout/ passes, if it is not NULL.
+static int futex_wait(atomic_uint *word, unsigned int val, const struct timespec *timeout) {
+    return syscall(SYS_futex, word, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *word, int n) {
+    syscall(SYS_futex, word, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+// Takes the next task off the ring; 0 if it is empty
+static int take(shared_t *sh, pool_task_t *fn, long *arg) {
+    unsigned long pos = atomic_load_explicit(&sh->head, memory_order_relaxed);
+
+    for (;;) {
+        slot_t *s = &sh->ring[pos & (RING_SIZE - 1)];
+        unsigned long seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+        long diff = (long)(seq - (pos + 1));
+
+        if (diff < 0) {
+            return 0;
+        }
+        if (diff > 0) {
+            // Another worker took it; try the next one
+            pos = atomic_load_explicit(&sh->head, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&sh->head, &pos, pos + 1,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            *fn = s->fn;
+            *arg = s->arg;
+            // Hand the slot back to the producer, one lap later
+            atomic_store_explicit(&s->seq, pos + RING_SIZE, memory_order_release);
+            return 1;
+        }
+    }
+}
+
+static void worker(shared_t *sh, void *area) {
+    pool_task_t fn;
+    long arg;
+    int spins = 0;
+
+    for (;;) {
+        // Read posted before looking at the ring, so that a task queued
+        // after the look changes it and the futex wait returns at once
+        unsigned int posted = atomic_load(&sh->posted);
+
+        if (take(sh, &fn, &arg)) {
+            fn(area, arg);
+            atomic_fetch_add(&sh->completed, 1);
+            if (atomic_load(&sh->parent_waiting)) {
+                futex_wake(&sh->completed, 1);
+            }
+            spins = 0;
+            continue;
+        }
+        if (atomic_load(&sh->stop)) {
+            _exit(0);
+        }
+        if (++spins < SPINS) {
+            continue;
+        }
+        atomic_fetch_add(&sh->sleepers, 1);
+        futex_wait(&sh->posted, posted, NULL);
+        atomic_fetch_sub(&sh->sleepers, 1);
+        spins = 0;
+    }
+}
+
+// Waits for a worker to complete a task, unless /done/ is out of date.
+// Returns -1 with errno ESRCH if nothing completed for CHECK_NS and a worker
+// turns out to have died: the task it held may never complete.
+static int wait_completed(pool_t *pool, unsigned int done) {
+    static const struct timespec check = {0, CHECK_NS};
+    int w, status;
+
+    if (futex_wait(&pool->sh->completed, done, &check) == 0 || errno != ETIMEDOUT) {
+        return 0;
+    }
+    for (w = 0; w < pool->workers; w++) {
+        if (pool->pids[w] > 0 && waitpid(pool->pids[w], &status, WNOHANG) == pool->pids[w]) {
+            pool->pids[w] = 0;
+            pool->dead++;
+        }
+    }
+    if (pool->dead > 0) {
+        errno = ESRCH;
+        return -1;
+    }
+    return 0;
+}
+
+pool_t *pool_create(int workers, size_t shared_size) {
+    pool_t *pool;
+    size_t header = (sizeof(shared_t) + 63) & ~(size_t)63;
+    unsigned long i;
+    int w;
+
+    if (workers < 1 || workers > MAX_WORKERS) {
+        errno = EINVAL;
+        return NULL;
+    }
+    pool = malloc(sizeof(pool_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    // MAP_SHARED before fork(): the one region the workers do not copy
+    pool->map_size = header + shared_size;
+    pool->sh = mmap(NULL, pool->map_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (pool->sh == MAP_FAILED) {
+        free(pool);
+        return NULL;
+    }
+    pool->area = (char *)pool->sh + header;
+    pool->submitted = 0;
+    pool->dead = 0;
+    for (i = 0; i < RING_SIZE; i++) {
+        atomic_init(&pool->sh->ring[i].seq, i);
+    }
+
+    for (w = 0; w < workers; w++) {
+        pid_t pid = fork();
+
+        if (pid == 0) {
+            worker(pool->sh, pool->area);
+        }
+        if (pid < 0) {
+            int saved = errno;
+
+            pool->workers = w;
+            pool_destroy(pool);
+            errno = saved;
+            return NULL;
+        }
+        pool->pids[w] = pid;
+    }
+    pool->workers = workers;
+    return pool;
+}
+
+void *pool_shared(pool_t *pool) {
+    return pool->area;
+}
+
+int pool_submit(pool_t *pool, pool_task_t fn, long arg) {
+    shared_t *sh = pool->sh;
+    unsigned long pos = atomic_load_explicit(&sh->tail, memory_order_relaxed);
+    slot_t *s = &sh->ring[pos & (RING_SIZE - 1)];
+
+    // Full: wait for the workers to free the slot a lap behind
+    while (atomic_load_explicit(&s->seq, memory_order_acquire) != pos) {
+        unsigned int done = atomic_load(&sh->completed);
+
+        atomic_store(&sh->parent_waiting, 1);
+        if (atomic_load_explicit(&s->seq, memory_order_acquire) != pos &&
+            wait_completed(pool, done) < 0) {
+            atomic_store(&sh->parent_waiting, 0);
+            return -1;
+        }
+        atomic_store(&sh->parent_waiting, 0);
+    }
+
+    s->fn = fn;
+    s->arg = arg;
+    atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+    atomic_store_explicit(&sh->tail, pos + 1, memory_order_relaxed);
+    pool->submitted++;
+
+    atomic_fetch_add(&sh->posted, 1);
+    if (atomic_load(&sh->sleepers) > 0) {
+        futex_wake(&sh->posted, 1);
+    }
+    return 0;
+}
+
+int pool_wait(pool_t *pool) {
+    shared_t *sh = pool->sh;
+    unsigned int done;
+
+    while ((done = atomic_load(&sh->completed)) != pool->submitted) {
+        atomic_store(&sh->parent_waiting, 1);
+        if (atomic_load(&sh->completed) == done && wait_completed(pool, done) < 0) {
+            atomic_store(&sh->parent_waiting, 0);
+            return -1;
+        }
+    }
+    atomic_store(&sh->parent_waiting, 0);
+    return 0;
+}
+
+int pool_destroy(pool_t *pool) {
+    shared_t *sh = pool->sh;
+    int w, status, failed = pool->dead;
+
+    atomic_store(&sh->stop, 1);
+    atomic_fetch_add(&sh->posted, 1);
+    futex_wake(&sh->posted, INT_MAX);
+
+    for (w = 0; w < pool->workers; w++) {
+        if (pool->pids[w] == 0) {
+            continue;
+        }
+        if (waitpid(pool->pids[w], &status, 0) < 0 ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed++;
+        }
+    }
+    munmap(sh, pool->map_size);
+    free(pool);
+    return failed;
+}
@@ -0,0 +1,50 @@
+#ifndef POOL_H
+#define POOL_H
+
+/* Pool of pre-forked worker processes.
+ *
+ * ex1.c and ex3.c show that a forked child writes to its own copy of the
+ * parent's pages. The pool instead puts everything the workers share in one
+ * MAP_SHARED mapping made before they are forked: a lock-free ring of tasks
+ * and a result area. The workers are forked once, by pool_create(), and
+ * write their results straight into the area, where the parent reads them
+ * with no copy.
+ *
+ * A task is a function and a long. The workers are forks of the parent, so
+ * any function of the program can be passed; pointers into the parent's
+ * memory are only good for what the parent had before pool_create().
+ */
+
+#include <stddef.h>
+
+typedef void (*pool_task_t)(void *shared, long arg);
+
+typedef struct pool pool_t;
+
+/* Maps /shared_size/ bytes of zeroed shared memory and forks /workers/
+ * processes. Returns NULL and sets errno on failure. */
+pool_t *pool_create(int workers, size_t shared_size);
+
+/* The shared area, at the same address in the parent and every worker */
+void *pool_shared(pool_t *pool);
+
+/* A worker that dies (a crashing task, a kill) never completes the task it
+ * held. pool_submit() and pool_wait() look for dead workers whenever no task
+ * has completed for 100 ms while they wait, and return -1 with errno ESRCH
+ * if they find one; the pool is then only good for pool_destroy().
+ */
+
+/* Queues fn(shared, arg) for the next idle worker. Waits while the ring is
+ * full. Only the parent submits. Returns 0, or -1 if a worker died. */
+int pool_submit(pool_t *pool, pool_task_t fn, long arg);
+
+/* Waits until every task submitted so far has run. Returns 0, or -1 if a
+ * worker died. */
+int pool_wait(pool_t *pool);
+
+/* Lets the workers finish the tasks queued, reaps them and unmaps the
+ * pool. Returns the number of workers that did not exit cleanly, dead
+ * ones included. */
+int pool_destroy(pool_t *pool);
+
+#endif /* POOL_H */
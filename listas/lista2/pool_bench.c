@@ -0,0 +1,160 @@
+/* Fork-per-task against the pool of pool.c, on the same tasks.
+ *
+ *   gcc -O2 -Wall pool_bench.c pool.c -o pool_bench
+ *   ./pool_bench [workers] [tasks] [work]
+ *
+ * Each task sums /work/ squares. Fork-per-task keeps up to /workers/
+ * children running and gets each result back through a pipe; the pool
+ * forks /workers/ processes once and each task writes its result into the
+ * shared array, which the parent reads in place. Both must agree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+static long work = 1000;
+
+static long compute(long task) {
+    long i, sum = 0;
+
+    for (i = 0; i < work; i++) {
+        sum += (task + i) * (task + i) % 1000003;
+    }
+    return sum;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* What the batch jobs do: one child per task, result over a pipe */
+static double fork_per_task(int workers, long tasks, long *results) {
+    int fds[workers][2];
+    long slot_task[workers];
+    double start = now();
+    long next = 0, running = 0;
+    int i;
+
+    for (i = 0; i < workers; i++) {
+        slot_task[i] = -1;
+    }
+    while (next < tasks || running > 0) {
+        for (i = 0; i < workers && next < tasks; i++) {
+            if (slot_task[i] >= 0) {
+                continue;
+            }
+            if (pipe(fds[i]) < 0) {
+                perror("pipe");
+                exit(1);
+            }
+            pid_t pid = fork();
+            if (pid == 0) {
+                long r = compute(next);
+
+                close(fds[i][0]);
+                if (write(fds[i][1], &r, sizeof(r)) != sizeof(r)) {
+                    _exit(1);
+                }
+                _exit(0);
+            }
+            if (pid < 0) {
+                perror("fork");
+                exit(1);
+            }
+            close(fds[i][1]);
+            slot_task[i] = next++;
+            running++;
+        }
+        // Collect one child, the first in slot order; the others keep running
+        for (i = 0; i < workers; i++) {
+            if (slot_task[i] < 0) {
+                continue;
+            }
+            if (read(fds[i][0], &results[slot_task[i]], sizeof(long)) != sizeof(long)) {
+                fprintf(stderr, "task %ld: short read\n", slot_task[i]);
+                exit(1);
+            }
+            close(fds[i][0]);
+            wait(NULL);
+            slot_task[i] = -1;
+            running--;
+            break;
+        }
+    }
+    return now() - start;
+}
+
+static void pool_task(void *shared, long task) {
+    long *results = shared;
+
+    results[task] = compute(task);
+}
+
+int main(int argc, char *argv[]) {
+    int workers = argc > 1 ? atoi(argv[1]) : 4;
+    long tasks = argc > 2 ? atol(argv[2]) : 10000;
+    double t_fork, t_pool, t_create;
+    long *expected, *results, i;
+    pool_t *pool;
+
+    if (argc > 3) {
+        work = atol(argv[3]);
+    }
+    if (workers < 1 || tasks < 1) {
+        fprintf(stderr, "usage: %s [workers] [tasks] [work]\n", argv[0]);
+        return 1;
+    }
+
+    expected = malloc(tasks * sizeof(long));
+    t_fork = fork_per_task(workers, tasks, expected);
+
+    t_create = now();
+    pool = pool_create(workers, tasks * sizeof(long));
+    if (pool == NULL) {
+        perror("pool_create");
+        return 1;
+    }
+    t_create = now() - t_create;
+    results = pool_shared(pool);
+
+    t_pool = now();
+    for (i = 0; i < tasks; i++) {
+        if (pool_submit(pool, pool_task, i) < 0) {
+            perror("pool_submit");
+            return 1;
+        }
+    }
+    if (pool_wait(pool) < 0) {
+        perror("pool_wait");
+        return 1;
+    }
+    t_pool = now() - t_pool;
+
+    for (i = 0; i < tasks; i++) {
+        if (results[i] != expected[i]) {
+            fprintf(stderr, "task %ld: pool %ld, fork %ld\n", i, results[i], expected[i]);
+            return 1;
+        }
+    }
+    if (pool_destroy(pool) != 0) {
+        fprintf(stderr, "a worker did not exit cleanly\n");
+        return 1;
+    }
+
+    printf("%d workers, %ld tasks of %ld\n", workers, tasks, work);
+    printf("fork per task: %8.3f s  %8.2f us/task\n", t_fork, t_fork / tasks * 1e6);
+    printf("pool:          %8.3f s  %8.2f us/task  (+%.3f ms to fork the pool)\n",
+           t_pool, t_pool / tasks * 1e6, t_create * 1e3);
+    printf("speedup:       %8.1fx\n", t_fork / (t_pool + t_create));
+    free(expected);
+    return 0;
+}
@@ -1,361 +1,338 @@
 /* Author(s): Samuel de Oliveira Krabbe e Leonardo de Moraes Perin
  * Creates operating system image suitable for placement on a boot disk
+ * (command line front end of libbuildimage)
 */
 
-#include <assert.h>
 #include <elf.h>
-#include <errno.h>
-#include <stdarg.h>
+#include <inttypes.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-// #define IMAGE_FILE "./image"
-#define BOOT_FILENAME "bootblock"
-#define KERNEL_FILENAME "kernel"
-#define ARGS "[--extended] <bootblock> <executable-file> ..."
-
-#define SECTOR_SIZE 512       /* floppy sector size in bytes */
-#define BOOTLOADER_SIG_OFFSET 0x1fe /* offset for boot loader signature */
-
-
-// Define a struct to hold the package values
-typedef struct {
-    FILE *imagefile;
-    FILE *bootfile;
-    FILE *kernelfile;
-    Elf32_Ehdr *boot_elf_header;
-    Elf32_Phdr *boot_program_header;
-    Elf32_Ehdr *kernel_elf_header;
-    Elf32_Phdr *kernel_program_header;
-    unsigned short num_kernel_sectors;
-} Package;
-
-
-/* Reads elf header from bootblock */
-void read_bootblock_ehdr(Package **my_package) {
-
-    // Allocate memory for the ELF header
-    (*my_package)->boot_elf_header = (Elf32_Ehdr*)malloc(sizeof(Elf32_Ehdr));
-
-    if ((*my_package)->boot_elf_header == NULL) {
-        perror("Memory allocation of boot_elf_header failed");
-        exit(EXIT_FAILURE);
-    }
-
-    // Read the ELF header from the file
-    if (fread((*my_package)->boot_elf_header, sizeof(Elf32_Ehdr), 1, (*my_package)->bootfile) != 1) {
-        fprintf(stderr, "Error reading ELF header from %s ELF file\n", BOOT_FILENAME);
-        free((*my_package)->boot_elf_header);
-    }
-}
-
-/* Reads elf header from kernel */
-void read_kernel_ehdr(Package **my_package) {
+#include "buildimage.h"
 
-    // Allocate memory for the ELF header
-    (*my_package)->kernel_elf_header = (Elf32_Ehdr*)malloc(sizeof(Elf32_Ehdr));
-
-    if ((*my_package)->kernel_elf_header == NULL) {
-        perror("Memory allocation of kernel_elf_header failed");
-        exit(EXIT_FAILURE);
-    }
-
-    // Read the ELF header from the file
-    if (fread((*my_package)->kernel_elf_header, sizeof(Elf32_Ehdr), 1, (*my_package)->kernelfile) != 1) {
-        fprintf(stderr, "Error reading ELF header from %s ELF file\n", KERNEL_FILENAME);
-        free((*my_package)->kernel_elf_header);
-    }
-}
-
-/* Reads program header table from bootblock */
-void read_bootblock_phdr(Package **my_package) {
+// #define IMAGE_FILE "./image"
+#define BOOT_FILENAME "./bootblock"
+#define KERNEL_FILENAME "./kernel"
+#define IMAGE_FILENAME "image"
+#define ARGS "[--extended] [--jobs N] [--compress <stub>] [--geometry <sectors>,<heads>] [--direct <device>] [--verify | --smoke [--json]] <bootblock> <executable-file> ...\n" \
+             "       buildimage [--jobs N] --batch <list>"
 
-    // Allocate memory for the ELF header
-    (*my_package)->boot_program_header = (Elf32_Phdr*)malloc(sizeof(Elf32_Phdr));
 
-    if ((*my_package)->boot_program_header == NULL) {
-        perror("Memory allocation of boot_program_header failed");
-        exit(EXIT_FAILURE);
-    }
+/* Prints what the library could not do, and exits */
+static void die(void) {
 
-    // Read program header table
-    fseek((*my_package)->bootfile, (*my_package)->boot_elf_header->e_phoff, SEEK_SET);
-    fread((*my_package)->boot_program_header, (*my_package)->boot_elf_header->e_phentsize, (*my_package)->boot_elf_header->e_phnum, (*my_package)->bootfile);
+    fprintf(stderr, "%s\n", buildimage_error());
+    exit(EXIT_FAILURE);
 }
 
-/* Reads program header table from kernel */
-void read_kernel_phdr(Package **my_package) {
-
-    // Allocate memory for the ELF header
-    (*my_package)->kernel_program_header = (Elf32_Phdr*)malloc(sizeof(Elf32_Phdr));
-
-    if ((*my_package)->kernel_program_header == NULL) {
-        perror("Memory allocation of kernel_program_header failed");
-        exit(EXIT_FAILURE);
+/* Writes s as a JSON string */
+void json_string(const char *s) {
+
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
     }
-
-    // Read program header table
-    fseek((*my_package)->kernelfile, (*my_package)->kernel_elf_header->e_phoff, SEEK_SET);
-    fread((*my_package)->kernel_program_header, (*my_package)->kernel_elf_header->e_phentsize, (*my_package)->kernel_elf_header->e_phnum, (*my_package)->kernelfile);
+    putchar('"');
 }
 
-/* Writes the bootblock to image */
-void write_bootblock(Package **my_package) {
+/* Prints what --verify found, as text or as JSON */
+void verify_report(Verification *v, int json) {
 
-    // Allocate memory for bootblock
-    unsigned char *bootblock = (unsigned char *)malloc((*my_package)->boot_program_header->p_memsz);
-    if (bootblock == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(EXIT_FAILURE);
-    }
-
-    // Read bootfile to bootblock
-    fseek((*my_package)->bootfile, (*my_package)->boot_program_header->p_offset, SEEK_SET);
+    size_t i, padding = 0, empty = 0;
 
-    // Read and write bootfile to image
-    fread(bootblock, (*my_package)->boot_program_header->p_filesz, 1, (*my_package)->bootfile);
-    fwrite(bootblock, (*my_package)->boot_program_header->p_filesz, 1, (*my_package)->imagefile);
-
-    // Write padding to the image
-    int bootblock_padding = (SECTOR_SIZE - 2) - (*my_package)->boot_program_header->p_filesz;
-    if (bootblock_padding > 0) {
-        unsigned char *padding_buffer = (unsigned char *)calloc(bootblock_padding, sizeof(unsigned char));
-        if (padding_buffer == NULL) {
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(EXIT_FAILURE);
-        }
-        memset(padding_buffer, 0, bootblock_padding);
-        fwrite(padding_buffer, sizeof(unsigned char), bootblock_padding, (*my_package)->imagefile);
-        free(padding_buffer);
+    for (i = 0; i < v->num_sectors; i++) {
+        padding += SECTOR_SIZE - (v->used[i] < SECTOR_SIZE ? v->used[i] : SECTOR_SIZE);
+        if (v->map[i] == '.')
+            empty++;
     }
 
-    // Write the boot signature (aa55) to the last two bytes
-    unsigned short boot_signature = 0xaa55;
-    fwrite(&boot_signature, sizeof(unsigned short), 1, (*my_package)->imagefile);
-
-    free(bootblock);
-}
-
-/* Writes the kernel to image */
-void write_kernel(Package **my_package) {
-
-    int i, kernel_padding, last_segment_size, last_sector_padding;
-    Elf32_Phdr current_header;
-    Elf32_Phdr next_header;
-
-    // Write each segment of program header
-    for (i = 0; i < (*my_package)->kernel_elf_header->e_phnum; i++)
-    {
-        current_header = (*my_package)->kernel_program_header[i];
-        next_header = (*my_package)->kernel_program_header[i + 1];
-
-        // Calculate kernel padding
-        kernel_padding = next_header.p_offset - (current_header.p_offset + current_header.p_filesz);
-        
-        if (i == ((*my_package)->kernel_elf_header->e_phnum - 1)) {
-            last_segment_size = (*my_package)->kernel_program_header[i].p_filesz;
-            last_sector_padding = SECTOR_SIZE - (last_segment_size % SECTOR_SIZE);
-            if (last_sector_padding == SECTOR_SIZE) 
-                kernel_padding = 0;
-            else 
-                kernel_padding = last_sector_padding;
+    if (json) {
+        printf("{\n  \"image\": ");
+        json_string(v->filename);
+        printf(",\n  \"ok\": %s,\n", v->num_errors == 0 ? "true" : "false");
+        printf("  \"size\": %zu,\n  \"sectors\": %zu,\n", v->size, v->num_sectors);
+        printf("  \"os_size\": %u,\n  \"expected_os_size\": %zu,\n", v->os_size, v->expected_os_size);
+        printf("  \"padding_bytes\": %zu,\n  \"padding_sectors\": %zu,\n", padding, empty);
+        printf("  \"sector_map\": \"%s\",\n", v->map);
+        printf("  \"segments\": [");
+        for (i = 0; i < (size_t)v->num_segments; i++) {
+            printf("%s\n    {\"file\": ", i ? "," : "");
+            json_string(v->segments[i].filename);
+            printf(", \"index\": %d, \"offset\": %zu, \"filesz\": %" PRIu64 ", \"checksum\": \"%016" PRIx64 "\", \"ok\": %s}",
+                   v->segments[i].index, v->segments[i].image_offset, v->segments[i].filesz,
+                   v->segments[i].found, v->segments[i].found == v->segments[i].expected ? "true" : "false");
         }
-
-        // Allocate memory for the segment
-        unsigned char *segment = (unsigned char *)malloc((*my_package)->kernel_program_header[i].p_memsz);
-        if (segment == NULL) {
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(EXIT_FAILURE);
+        printf("\n  ],\n  \"errors\": [");
+        for (i = 0; i < (size_t)v->num_errors; i++) {
+            printf("%s\n    ", i ? "," : "");
+            json_string(v->errors[i]);
         }
-
-        // Read segment from kernelfile
-        fseek((*my_package)->kernelfile, (*my_package)->kernel_program_header[i].p_offset, SEEK_SET);
-        fread(segment, (*my_package)->kernel_program_header[i].p_filesz, 1, (*my_package)->kernelfile);
-
-        // Write segment to the image
-        fwrite(segment, (*my_package)->kernel_program_header[i].p_filesz, 1, (*my_package)->imagefile);
-
-        // Write kernel padding to the image
-        if (kernel_padding > 0) {
-            unsigned char *padding_buffer = (unsigned char *)calloc(kernel_padding, sizeof(unsigned char));
-            if (padding_buffer == NULL) {
-                fprintf(stderr, "Memory allocation failed\n");
-                exit(EXIT_FAILURE);
-            }
-            memset(padding_buffer, 0, kernel_padding);
-            fwrite(padding_buffer, sizeof(unsigned char), kernel_padding, (*my_package)->imagefile);
-            free(padding_buffer);
-        }
-
-        free(segment);
+        printf("\n  ]\n}\n");
+        return;
     }
-}
-
-/* Counts the number of sectors in the kernel */
-void count_kernel_sectors(Package **my_package) {   
 
-    int i;
-    unsigned int total_kernel_size = 0;
-
-    // Iterate through all program headers and sum up the sizes of all segments
-    for (i = 0; i < (*my_package)->kernel_elf_header->e_phnum; i++) {
-        total_kernel_size += (*my_package)->kernel_program_header[i].p_filesz;
+    printf("image: %zu bytes, %zu sectors, os_size %u\n", v->size, v->num_sectors, v->os_size);
+    for (i = 0; i < (size_t)v->num_segments; i++) {
+        printf("  %s segment %d at 0x%04zx, 0x%04" PRIx64 " bytes, checksum %016" PRIx64 ": %s\n",
+               v->segments[i].filename, v->segments[i].index, v->segments[i].image_offset, v->segments[i].filesz,
+               v->segments[i].found, v->segments[i].found == v->segments[i].expected ? "ok" : "MISMATCH");
     }
 
-    // Calculate the number of sectors required to store the kernel
-    (*my_package)->num_kernel_sectors = (unsigned short)((total_kernel_size + SECTOR_SIZE - 1) / SECTOR_SIZE);
-}
-
-
-/* Records the number of sectors in the kernel to 2nd position in image */
-void record_kernel_sectors(Package **my_package) {
+    printf("\nsector map (B boot, P read plan, T module table, Z stub and payload, # data, + data and padding, . padding):\n");
+    for (i = 0; i < v->num_sectors; i += 64)
+        printf("  %6zu  %.64s\n", i, v->map + i);
+    printf("padding: %zu bytes, %zu sectors hold nothing else\n\n", padding, empty);
 
-    // Write os_size into 2nd position of image
-    fseek((*my_package)->imagefile, sizeof(unsigned short), SEEK_SET);
-    fwrite(&((*my_package)->num_kernel_sectors), 2, 1, (*my_package)->imagefile);
+    for (i = 0; i < (size_t)v->num_errors; i++)
+        printf("error: %s\n", v->errors[i]);
+    printf("verify: %s\n", v->num_errors == 0 ? "ok" : "FAILED");
 }
 
-// Builds image
-void build_image(Package **my_package) {
+/* Prints what --smoke found, as text or as JSON */
+void smoke_report(BootCheck *c, int json) {
 
-    if ((*my_package)->imagefile == NULL) {
-        (*my_package)->imagefile = fopen("image", "wb");
-        if ((*my_package)->imagefile == NULL) {
-            perror("Error opening imagefile");
-            exit(EXIT_FAILURE);
+    int i;
+
+    if (json) {
+        printf("{\n  \"image\": ");
+        json_string(c->filename);
+        printf(",\n  \"ok\": %s,\n", c->num_errors == 0 ? "true" : "false");
+        printf("  \"os_size\": %u,\n  \"reads\": %d,\n", c->os_size, c->reads);
+        printf("  \"load_start\": %zu,\n  \"load_end\": %zu,\n  \"entry\": %zu,\n", c->load_start, c->load_end, c->entry);
+        printf("  \"segments\": %d,\n  \"segments_ok\": %d,\n", c->total_segments, c->num_segments);
+        printf("  \"errors\": [");
+        for (i = 0; i < c->num_errors; i++) {
+            printf("%s\n    ", i ? "," : "");
+            json_string(c->errors[i]);
         }
+        printf("\n  ]\n}\n");
+        return;
     }
 
-    // Write bootblock to image
-    write_bootblock(my_package);
+    printf("boot: os_size %u, %d BIOS reads", c->os_size, c->reads);
+    if (c->load_end > 0)
+        printf(" to 0x%05zx-0x%05zx", c->load_start, c->load_end);
+    printf("\nentry: 0x%05zx\n", c->entry);
+    printf("segments in place: %d of %d\n", c->num_segments, c->total_segments);
+    for (i = 0; i < c->num_errors; i++)
+        printf("error: %s\n", c->errors[i]);
+    printf("smoke: %s\n", c->num_errors == 0 ? "ok" : "FAILED");
+}
 
-    // Write kernel to image
-    write_kernel(my_package);
+/* Prints one segment for --extended option */
+void extended_segment(Segment *segment, int i, size_t padding_up_to) {
 
-    // Record number of kernel sectors in image
-    record_kernel_sectors(my_package);
+    printf("  Segment %d:\n", i);
+    printf("    offset: 0x%04" PRIx64 "\n", segment->offset);
+    printf("    vaddr: 0x%04" PRIx64 "\n", segment->vaddr);
+    printf("    filesz: 0x%04" PRIx64 "\n", segment->filesz);
+    printf("    memsz: 0x%04" PRIx64 "\n", segment->memsz);
+    printf("    writing 0x%04" PRIx64 " bytes\n", segment->filesz);
+    printf("    padding up to 0x%04zx\n", padding_up_to);
+    printf("\n");
 }
 
-
 /* Prints segment information for --extended option */
 void extended_opt(Package *my_package) {
 
-    int bootblock_padding, kernel_padding, last_segment_size, last_sector_padding;
-    Elf32_Phdr current_header;
-    Elf32_Phdr next_header;
-    int i, j;
+    Executable *boot = &my_package->boot;
+    Executable *exe;
+    int i, k;
 
     // Bootblock segment info
-    printf("0x%04x: ./%s\n", my_package->boot_program_header[0].p_vaddr, BOOT_FILENAME);
-    for (i = 0; i < my_package->boot_elf_header->e_phnum; ++i) {
-        bootblock_padding = SECTOR_SIZE - my_package->boot_program_header->p_filesz;
-
-        printf("  Segment %d:\n", i);
-        printf("    offset: 0x%04x\n", my_package->boot_program_header[i].p_offset);
-        printf("    vaddr: 0x%04x\n", my_package->boot_program_header[i].p_vaddr);
-        printf("    filesz: 0x%04x\n", my_package->boot_program_header[i].p_filesz);
-        printf("    memsz: 0x%04x\n", my_package->boot_program_header[i].p_memsz);
-        printf("    writing 0x%04x bytes\n", my_package->boot_program_header[i].p_memsz);
-        printf("    padding uo to 0x%04x\n", my_package->boot_program_header[i].p_filesz + bootblock_padding);
-        printf("\n");
-    }
+    printf("0x%04" PRIx64 ": %s\n", boot->segments[0].vaddr, boot->filename);
+    extended_segment(&boot->segments[0], 0, SECTOR_SIZE);
 
     // Print kernel segment info
-    printf("0x%04x: ./%s\n", my_package->kernel_program_header[0].p_vaddr, KERNEL_FILENAME);
-    for (j = 0; j < my_package->kernel_elf_header->e_phnum; ++j) {
-        current_header = my_package->kernel_program_header[j];
-        next_header = my_package->kernel_program_header[j + 1];
-
-        kernel_padding = next_header.p_offset - (current_header.p_offset + current_header.p_filesz);
-        if (j == (my_package->kernel_elf_header->e_phnum - 1)) {
-            last_segment_size = my_package->kernel_program_header[j].p_filesz;
-            last_sector_padding = SECTOR_SIZE - (last_segment_size % SECTOR_SIZE);
-            if (last_sector_padding == SECTOR_SIZE) 
-                kernel_padding = 0;
-            else 
-                kernel_padding = last_sector_padding;
+    for (k = 0; k < my_package->num_kernels; k++) {
+        exe = &my_package->kernels[k];
+        printf("0x%04" PRIx64 ": %s (ELF%d)\n", exe->segments[0].vaddr, exe->filename, exe->elf_class == ELFCLASS64 ? 64 : 32);
+        for (i = 0; i < exe->num_segments; ++i)
+            extended_segment(&exe->segments[i], i, i + 1 < exe->num_segments ? exe->image_offset[i + 1] : exe->image_end);
+        if (exe->bss_size > 0)
+            printf("  bss: 0x%04" PRIx64 " bytes past the last sector, zeroed by the loader\n\n", exe->bss_size);
+    }
+
+    if (my_package->num_kernels > 1) {
+        printf("module table (sector %d):\n", MODULE_TABLE_SECTOR);
+        for (k = 0; k < my_package->num_kernels; k++) {
+            exe = &my_package->kernels[k];
+            printf("  %d: sector %zu, %zu sectors, entry 0x%04" PRIx64 ", bss %u paragraphs\n", k, exe->image_start / SECTOR_SIZE,
+                   (exe->image_end - exe->image_start) / SECTOR_SIZE, exe->entry, bss_paragraphs(exe));
         }
-        kernel_padding += my_package->boot_program_header[i].p_filesz + bootblock_padding + my_package->kernel_program_header[j].p_filesz;
-
-        printf("  Segment %d:\n", j);
-        printf("    offset: 0x%04x\n", my_package->kernel_program_header[j].p_offset);
-        printf("    vaddr: 0x%04x\n", my_package->kernel_program_header[j].p_vaddr);
-        printf("    filesz: 0x%04x\n", my_package->kernel_program_header[j].p_filesz);
-        printf("    memsz: 0x%04x\n", my_package->kernel_program_header[j].p_memsz);
-        printf("    writing 0x%04x bytes\n", my_package->kernel_program_header[j].p_memsz);
-        printf("    padding uo to 0x%04x\n", kernel_padding);
         printf("\n");
     }
 
     // Print os_size
     printf("os_size: %d\n", my_package->num_kernel_sectors);
+    if (my_package->compress)
+        printf("compressed: %zu -> %zu bytes (%.1f%%), %zu sectors saved over %zu\n",
+               my_package->kernel_span, my_package->payload_size,
+               100.0 * my_package->payload_size / my_package->kernel_span,
+               my_package->kernel_span / SECTOR_SIZE - my_package->num_kernel_sectors,
+               my_package->kernel_span / SECTOR_SIZE);
+    if (my_package->plan != NULL) {
+        printf("read plan (sector %d): %d sectors per track, %d heads, kernel from sector %zu\n", READ_PLAN_SECTOR,
+               my_package->sectors_per_track, my_package->heads, my_package->kernel_sector);
+        for (i = 0; i < my_package->plan_runs; i++) {
+            read_run_t *run = &my_package->plan[i];
+
+            printf("  C %3d H %d S %2d: %3d sectors to 0x%04x:0000\n", (run->cx >> 8) | (run->cx & 0xc0) << 2,
+                   run->dh, run->cx & 0x3f, run->al, run->es);
+        }
+        // One more call reads the plan itself
+        printf("BIOS reads: %d with the plan, %d one sector at a time\n", my_package->plan_runs + 1, my_package->num_kernel_sectors);
+    }
+    if (my_package->incremental)
+        printf("incremental build: rewrote %s%d of %d segments\n", my_package->boot_written ? "the bootblock and " : "", my_package->segments_written, my_package->total_segments);
+    if (my_package->copy_method != NULL)
+        printf("segments copied with %s\n", my_package->copy_method);
     printf("\n");
 }
 
 /* MAIN */
 int main(int argc, char **argv)
 {
+    int extended = 0, jobs = 1, verify = 0, smoke = 0, json = 0;
+    int sectors_per_track = 0, heads = 0;
+    const char *compress_stub = NULL, *batch_list = NULL, *direct = NULL;
+    int i, first;
+
+    // Options, then the bootblock and the kernels
+    for (first = 1; first < argc && !strncmp(argv[first], "--", 2); first++) {
+        if (!strcmp(argv[first], "--extended")) {
+            extended = 1;
+        } else if (!strcmp(argv[first], "--jobs") && first + 1 < argc && atoi(argv[first + 1]) > 0) {
+            jobs = atoi(argv[++first]);
+        } else if (!strcmp(argv[first], "--verify")) {
+            verify = 1;
+        } else if (!strcmp(argv[first], "--smoke")) {
+            smoke = 1;
+        } else if (!strcmp(argv[first], "--json")) {
+            json = 1;
+        } else if (!strcmp(argv[first], "--compress") && first + 1 < argc) {
+            compress_stub = argv[++first];
+        } else if (!strcmp(argv[first], "--geometry") && first + 1 < argc
+                   && sscanf(argv[first + 1], "%d,%d", &sectors_per_track, &heads) == 2) {
+            first++;
+        } else if (!strcmp(argv[first], "--direct") && first + 1 < argc) {
+            direct = argv[++first];
+        } else if (!strcmp(argv[first], "--batch") && first + 1 < argc) {
+            batch_list = argv[++first];
+        } else {
+            printf("\n");
+            printf("Unknown option. Usage: %s %s\n", argv[0], ARGS);
+            printf("\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    // A batch builds on every CPU unless told otherwise
+    if (batch_list != NULL) {
+        BatchSummary summary;
+
+        for (i = 1; i < argc && strcmp(argv[i], "--jobs"); i++)
+            ;
+        if (i == argc)
+            jobs = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+        if (build_batch(batch_list, jobs, &summary) < 0)
+            die();
+        if (summary.num_images > 0)
+            printf("batch: %d images from %d distinct inputs (%zu bytes)\n", summary.num_images, summary.num_inputs, summary.input_bytes);
+        return 0;
+    }
+
+    if (argc - first == 1) {
+        printf("\n");
+        printf("Usage: %s %s\n", argv[0], ARGS);
+        printf("\n");
+        exit(EXIT_FAILURE);
+    }
+
     // Package structure that holds all the values I will need
-    Package *my_package = malloc(sizeof(Package));
+    Package *my_package = calloc(1, sizeof(Package));
     if (my_package == NULL) {
         perror("Error allocating memory for my_package");
         exit(EXIT_FAILURE);
     }
 
-    // Opens bootfile
-    my_package->bootfile = fopen(BOOT_FILENAME, "rb");
-    if (my_package->bootfile == NULL) {
-        printf("Error opening %s\n", BOOT_FILENAME);
+    // Without file names, ./bootblock and ./kernel are packed into ./image
+    my_package->image_filename = IMAGE_FILENAME;
+    my_package->num_kernels = first < argc ? argc - first - 1 : 1;
+    if (my_package->num_kernels > (int)MAX_MODULES) {
+        fprintf(stderr, "At most %d executables fit in the module table\n", (int)MAX_MODULES);
         exit(EXIT_FAILURE);
     }
-
-    // Opens kernelfile
-    my_package->kernelfile = fopen(KERNEL_FILENAME, "rb");
-    if (my_package->kernelfile == NULL) {
-        printf("Error opening %s\n", KERNEL_FILENAME);
+    my_package->kernels = (Executable *)calloc(my_package->num_kernels, sizeof(Executable));
+    if (my_package->kernels == NULL) {
+        perror("Error allocating memory for my_package");
         exit(EXIT_FAILURE);
     }
+    my_package->boot.filename = first < argc ? argv[first] : BOOT_FILENAME;
+    for (i = 0; i < my_package->num_kernels; i++)
+        my_package->kernels[i].filename = first < argc ? argv[first + 1 + i] : KERNEL_FILENAME;
+    my_package->stub.filename = compress_stub;
+    my_package->compress = compress_stub != NULL;
+    my_package->sectors_per_track = sectors_per_track;
+    my_package->heads = heads;
+
+    // Opens, maps, parses and hashes every input, on --jobs threads
+    if (load_inputs(my_package, jobs) < 0)
+        die();
+
+    // --verify checks the image already built against the inputs instead
+    if (verify) {
+        Verification verification;
+
+        if (verify_image(my_package, &verification) < 0)
+            die();
+        verify_report(&verification, json);
+        return verification.num_errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-    // Read ELF files' ELF headers
-    read_bootblock_ehdr(&my_package);
-    read_kernel_ehdr(&my_package);
-
-	/* read ELF files' program headers */  
-    read_bootblock_phdr(&my_package);
-    read_kernel_phdr(&my_package);
+    // --smoke boots the image already built, in memory
+    if (smoke) {
+        BootCheck check;
 
-    /* Counts the number of sectors in kernelfile */
-    count_kernel_sectors(&my_package);
+        if (boot_image(my_package, &check) < 0)
+            die();
+        smoke_report(&check, json);
+        return check.num_errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-	/* builds image*/
-    build_image(&my_package);
+    // --direct writes straight to a device (or a file) instead of ./image
+    if (direct != NULL) {
+        DirectWrite w;
+
+        if (build_image_direct(my_package, direct, &w) < 0)
+            die();
+        printf("%s: %zu bytes in %d write%s%s and one fsync, %.3f s (%.1f MB/s)\n", direct, w.bytes, w.writes, w.writes == 1 ? "" : "s",
+               w.direct ? " with O_DIRECT" : "", w.seconds, w.seconds > 0 ? w.bytes / w.seconds / 1e6 : 0.0);
+    } else if (build_image(my_package) < 0) {
+        /* builds image*/
+        die();
+    }
 
 	/* check for --extended option */
-    if (argc > 1) {
-        if (!strncmp(argv[1], "--extended", 11)) {
-            extended_opt(my_package);
-        } else {
-            // Case where the argument is not "--extended"
-            printf("\n");
-            printf("Unknown option. Usage: ./program --extended\n");
-            printf("\n");
-        }
-    } else {
-        // Case where no command line argument is provided
-        printf("\n");
-        printf("Usage: %s\n", ARGS);
-        printf("\n");
-    }
-	
-	// Cleaning pointers and closing files
-    free(my_package->boot_elf_header);
-    free(my_package->kernel_elf_header);
-    free(my_package->boot_program_header);
-    free(my_package->kernel_program_header);
-    fclose(my_package->bootfile);
-    fclose(my_package->kernelfile);
-	fclose(my_package->imagefile);
-  
+    if (extended)
+        extended_opt(my_package);
+
+	// Closing files
+    release_image(my_package);
+    close_executable(&my_package->boot);
+    if (my_package->compress)
+        close_executable(&my_package->stub);
+    for (i = 0; i < my_package->num_kernels; i++)
+        close_executable(&my_package->kernels[i]);
+    free(my_package->kernels);
+    free(my_package);
+
 	return 0;
 }
@@ -0,0 +1,286 @@
+#ifndef BUILDIMAGE_H
+#define BUILDIMAGE_H
+
+/* libbuildimage: packs a bootblock and one or more executables into a boot
+ * disk image, in a file, on a caller's descriptor or in a caller's buffer.
+ * buildimage(1) is a thin wrapper around it.
+ *
+ * Functions that can fail return -1 and leave a message for
+ * buildimage_error(). Nothing in the library prints or exits, except on an
+ * allocation failure.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SECTOR_SIZE 512       /* floppy sector size in bytes */
+#define BOOTLOADER_SIG_OFFSET 0x1fe /* offset for boot loader signature */
+#define OS_SIZE_OFFSET 2      /* sectors the loader reads after the boot sector */
+
+/* The loader zeroes this many 16-byte paragraphs past the sectors it read:
+ * the BSS that is not stored in the image */
+#define BSS_PARAGRAPHS_OFFSET 4
+
+/* With more than one executable, sector 1 holds a module table and every
+ * executable follows it on a sector boundary, so the loader can fetch each
+ * one with a single run of sector reads. os_size then covers the table and
+ * all modules. A single executable keeps the original layout (kernel right
+ * after the boot sector, no table). */
+#define MODULE_TABLE_SECTOR 1
+#define MODULE_TABLE_MAGIC 0x4c444f4d /* "MODL" */
+#define MAX_MODULES ((SECTOR_SIZE - sizeof(module_table_header_t)) / sizeof(module_entry_t))
+
+/* With a disk geometry, sector 1 holds a read plan instead and what the
+ * loader reads to KERNEL_ADDR (the kernel, or the stub and its payload)
+ * starts on the next track. Each run of the plan is one int 13h, AH=02
+ * call, stored as the registers it takes: the loader reads the plan
+ * sector, then for each run loads CX, DH, AL and ES and reads to ES:0. A
+ * run stays within a track and never crosses a 64 KB boundary, which the
+ * floppy DMA cannot. */
+#define READ_PLAN_SECTOR 1
+#define READ_PLAN_MAGIC 0x4e414c50 /* "PLAN" */
+#define MAX_READ_RUNS ((SECTOR_SIZE - sizeof(read_plan_header_t)) / sizeof(read_run_t))
+
+#define MANIFEST_SUFFIX ".manifest" /* next to the image */
+
+/* Where the bootblock reads the sectors that follow the boot sector, and
+ * jumps (0x100:0). The Makefile passes its own. */
+#ifndef KERNEL_ADDR
+#define KERNEL_ADDR 0x1000
+#endif
+
+/* The loader runs in real mode: nothing can be placed past the first 1 MB,
+ * and os_size and the module sector counts are 16 bits */
+#define REAL_MODE_LIMIT 0x100000
+#define MAX_SECTORS 0xffff
+
+typedef struct {
+    uint32_t magic;
+    uint16_t count;             // Entries that follow
+    uint16_t reserved;
+} __attribute__((packed)) module_table_header_t;
+
+typedef struct {
+    uint32_t sector;            // First sector of the module (LBA)
+    uint16_t num_sectors;
+    uint16_t bss_paragraphs;    // To zero past the last sector
+    uint32_t entry;             // e_entry
+    uint32_t load_vaddr;        // vaddr of the first segment
+} __attribute__((packed)) module_entry_t;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t count;             // Runs that follow
+    uint8_t sectors_per_track;
+    uint8_t heads;
+} __attribute__((packed)) read_plan_header_t;
+
+typedef struct {
+    uint16_t cx;                // Cylinder in CH and the top of CL, sector (from 1) below
+    uint8_t dh;                 // Head
+    uint8_t al;                 // Sectors to read
+    uint16_t es;                // Segment to read to, at offset 0
+} __attribute__((packed)) read_run_t;
+
+// A PT_LOAD segment, from an ELF32 or ELF64 program header
+typedef struct {
+    uint64_t offset;            // In the file
+    uint64_t vaddr;
+    uint64_t filesz;
+    uint64_t memsz;
+} Segment;
+
+// One ELF input: the bootblock or one of the executables
+typedef struct {
+    const char *filename;       // Or just a name, for an input in memory
+    int fd;                     // -1 for an input in memory
+    unsigned char *map;         // Read-only mapping of the whole file, or the caller's bytes
+    size_t size;
+    int elf_class;              // ELFCLASS32 or ELFCLASS64
+    uint64_t entry;
+    Segment *segments;          // PT_LOAD only, sorted by vaddr
+    int num_segments;
+    // Layout and contents, compared against the manifest of the last build
+    size_t image_start;         // First byte in the image
+    size_t image_end;           // One past the last sector
+    uint64_t bss_size;          // Memory past the last sector, zeroed by the loader
+    size_t *image_offset;       // Where each segment goes in the image
+    uint64_t *hash;             // FNV-1a of each segment
+} Executable;
+
+/* One image: its inputs, where it goes and how the last build went. The
+ * inputs are loaded by the caller; several packages may share them by
+ * copying the Executable structs, since the layout is per package. */
+typedef struct {
+    const char *image_filename; // For build_image() and verify_image()
+    int imagefile;
+    unsigned char *image_map;   // Where the image is being written
+    size_t image_size;          // Set by prepare_image()
+    Executable boot;
+    Executable stub;            // Decompressor, when compress is set
+    Executable *kernels;
+    int num_kernels;
+    int total_segments;
+    unsigned short num_kernel_sectors;
+    const char *copy_method;    // How the last kernel segment was copied
+    int boot_written;
+    int segments_written;       // Kernel segments rewritten by this build
+    int incremental;            // Whether the image was updated in place
+    int compress;
+    unsigned char *payload;     // Compressed kernel, from prepare_image()
+    size_t payload_size;
+    size_t kernel_span;         // Same kernel, uncompressed
+    int sectors_per_track;      // Disk geometry, for a read plan; 0 for none
+    int heads;
+    size_t kernel_sector;       // First sector read to KERNEL_ADDR, from prepare_image()
+    read_run_t *plan;           // The read plan, with a geometry
+    int plan_runs;
+} Package;
+
+/* One checked kernel segment, for the --verify report */
+typedef struct {
+    const char *filename;
+    int index;
+    size_t image_offset;
+    uint64_t filesz;
+    uint64_t expected;          // Checksum of the ELF segment
+    uint64_t found;             // Checksum of the same bytes in the image
+} SegmentCheck;
+
+/* What verify_image() found */
+typedef struct {
+    const char *filename;
+    const unsigned char *image; // Only while the image is being checked
+    size_t size;
+    size_t num_sectors;
+    unsigned int *used;         // Bytes of each sector that hold data
+    char *map;                  // One character per sector
+    unsigned short os_size;
+    size_t expected_os_size;    // May not fit in os_size, which is an error
+    SegmentCheck *segments;
+    int num_segments;
+    char **errors;
+    int num_errors;
+} Verification;
+
+/* What boot_image() found */
+typedef struct {
+    const char *filename;
+    unsigned short os_size;
+    int reads;                  // int 13h calls, of one sector or a run of the read plan
+    size_t disk_sectors;        // What the geometry addresses
+    size_t load_start;          // Linear range the reads wrote
+    size_t load_end;
+    size_t entry;               // Where control ends up, past the loader and the stub
+    int num_segments;           // Kernel segments in place after booting
+    int total_segments;
+    char **errors;
+    int num_errors;
+} BootCheck;
+
+/* What build_image_direct() did */
+typedef struct {
+    size_t bytes;               // Written, with the padding to a whole block
+    int writes;                 // write() calls
+    int direct;                 // Whether O_DIRECT was used
+    double seconds;             // From opening the target to its fsync
+} DirectWrite;
+
+/* What build_batch() did */
+typedef struct {
+    int num_images;
+    int num_inputs;             // Distinct inputs, each loaded once
+    size_t input_bytes;
+} BatchSummary;
+
+/* Message of the last failure on the calling thread */
+const char *buildimage_error(void);
+
+/* Opens, maps, parses and hashes exe->filename */
+int load_executable(Executable *exe);
+
+/* Same for an ELF file already in memory. The bytes are used in place and
+ * must outlive exe; /name/ is only used in messages. */
+int load_executable_memory(Executable *exe, const char *name, const void *data, size_t size);
+
+/* Loads the bootblock, every kernel and the stub of a package, on up to
+ * /jobs/ threads */
+int load_inputs(Package *package, int jobs);
+
+/* Unmaps and closes an input */
+void close_executable(Executable *exe);
+
+/* Lays out the kernels of a package (and compresses the kernel, with
+ * compress set). Sets image_size: how many bytes the image needs. With a
+ * geometry (a single kernel only), aligns the kernel to a track and plans
+ * the reads. */
+int prepare_image(Package *package);
+
+/* Writes the image into /buffer/, which must hold image_size bytes. Calls
+ * prepare_image() first if it was not. */
+int build_image_buffer(Package *package, void *buffer, size_t capacity);
+
+/* Writes the image to fd. A file open for reading and writing is truncated
+ * to the image and written in place; anything else (a pipe, a socket, a
+ * write-only file) gets the image from its current position. fd stays
+ * open. */
+int build_image_fd(Package *package, int fd);
+
+/* Writes the image to a block device or a regular file at /path/ with
+ * O_DIRECT: built in an aligned buffer, written from offset 0 in chunks of
+ * up to a megabyte, then one fsync. A file is created if needed, sized
+ * ahead and cut to the image; a device must hold it. Falls back to
+ * buffered writes where the filesystem refuses O_DIRECT. No manifest is
+ * kept. */
+int build_image_direct(Package *package, const char *path, DirectWrite *w);
+
+/* Writes the image to image_filename, updating it in place when the
+ * manifest of the last build allows it */
+int build_image(Package *package);
+
+/* Frees what prepare_image() allocated, so the package can be laid out
+ * again. The inputs stay loaded. */
+void release_image(Package *package);
+
+/* Checks a built image against the inputs of the package: boot signature,
+ * os_size, the BSS field or module table, and the checksum of every kernel
+ * segment. Builds a map of the sectors holding data and padding along the
+ * way. Returns the number of errors found, or -1 if the image cannot be
+ * read. verify_image() reads image_filename. */
+int verify_image_buffer(Package *package, Verification *v, const void *image, size_t size);
+int verify_image(Package *package, Verification *v);
+
+/* Frees what a verification allocated */
+void free_verification(Verification *v);
+
+/* Boots a built image the way the bootblock does, without an emulator:
+ * checks the signature, reads os_size sectors one by one to KERNEL_ADDR
+ * within the floppy geometry (or runs the read plan, with a geometry), zeroes the BSS, runs the decompressor of a
+ * compressed image (or loads each module of a multi-kernel image), and
+ * checks that every kernel segment ends up where it was linked, BSS
+ * zeroed, with control at its entry point. Returns the number of errors
+ * found, or -1 if the image cannot be read. boot_image() reads
+ * image_filename. Only the kernels of the package need to be loaded, and
+ * the stub if the code of the decompressor is to be checked too. */
+int boot_image_buffer(Package *package, BootCheck *c, const void *image, size_t size);
+int boot_image(Package *package, BootCheck *c);
+
+/* Frees what a boot check allocated */
+void free_boot_check(BootCheck *c);
+
+/* Returns the BSS of exe in 16-byte paragraphs, as the loader takes it */
+unsigned short bss_paragraphs(const Executable *exe);
+
+/* Inflates a payload written with compress set into out. Returns the size
+ * inflated, or -1 if the payload is malformed or does not fit. */
+long lz4_decompress(const unsigned char *in, size_t n, unsigned char *out, size_t capacity);
+
+/* Builds every image of a list, one per line, as
+ *
+ *   [--compress <stub>] <output> <bootblock> <executable-file> ...
+ *
+ * with blank lines and lines starting with # skipped. Each distinct input
+ * is loaded once and the images are written on up to /jobs/ threads. */
+int build_batch(const char *list, int jobs, BatchSummary *summary);
+
+#endif
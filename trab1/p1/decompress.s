@@ -0,0 +1,201 @@
+.text                               # Code segment
+.code16                             # Real mode
+.globl _start
+
+#
+# Decompressor placed ahead of the kernel by buildimage --compress.
+#
+# The bootblock loads it, with the compressed kernel right behind it, at
+# LOAD_SEGMENT:0 and jumps to it. It moves itself and the payload out of
+# the way to RELOC_SEGMENT, inflates the kernel to the segment it was
+# linked for, zeroes the BSS and jumps to the kernel entry point.
+#
+# The payload is a sequence of LZ4-style sequences:
+#
+#   token       high nibble: literal count, low nibble: match length - 4
+#   [length]    255s and a last byte added to a nibble that is 15
+#   literals
+#   offset      16-bit distance back to the match, absent in the last
+#               sequence; 0 means the sequence has literals only
+#   [length]    extension of the match length
+#
+# buildimage keeps every length below 0xf000 and every offset at or
+# below 0xfff0 so that each copy fits in a segment. Segment:offset pairs
+# are normalized (offset below 16) after each copy.
+#
+
+  .equ LOAD_SEGMENT, 0x100          # Where the bootblock put us
+  .equ RELOC_SEGMENT, 0x6000        # Where we inflate from
+  .equ CHUNK_PARAGRAPHS, 0x800      # 32 KiB
+
+_start:
+  jmp start
+
+# Parameters, filled in by buildimage
+image_paragraphs:   .word 0         # Stub and payload, to move
+payload_paragraph:  .word 0         # Start of the payload in the stub
+payload_size:       .long 0         # In bytes
+kernel_segment:     .word 0         # Where the kernel is linked
+kernel_entry:       .word 0         # Entry point, in kernel_segment
+bss_paragraphs:     .word 0         # To zero past the kernel
+
+# End of the payload, normalized
+end_segment:        .word 0
+end_offset:         .word 0
+
+start:
+  cld
+
+  # Move the stub and the payload to RELOC_SEGMENT, 32 KiB at a time
+  mov %cs:image_paragraphs, %bx
+  mov $LOAD_SEGMENT, %ax
+  mov %ax, %ds
+  mov $RELOC_SEGMENT, %ax
+  mov %ax, %es
+relocate:
+  mov %bx, %cx
+  cmp $CHUNK_PARAGRAPHS, %cx
+  jbe 1f
+  mov $CHUNK_PARAGRAPHS, %cx
+1:
+  sub %cx, %bx
+  shl $3, %cx                       # Paragraphs to words
+  xor %si, %si
+  xor %di, %di
+  rep movsw
+  mov %ds, %ax
+  add $CHUNK_PARAGRAPHS, %ax
+  mov %ax, %ds
+  mov %es, %ax
+  add $CHUNK_PARAGRAPHS, %ax
+  mov %ax, %es
+  test %bx, %bx
+  jnz relocate
+  ljmp $RELOC_SEGMENT, $inflate
+
+inflate:
+  # ds:si walks the payload, es:di the kernel
+  mov %cs, %ax
+  add %cs:payload_paragraph, %ax
+  mov %ax, %ds
+  xor %si, %si
+  mov %cs:kernel_segment, %ax
+  mov %ax, %es
+  xor %di, %di
+
+  # end = ds:0 + payload_size
+  mov %cs:payload_size, %ax
+  mov %cs:payload_size + 2, %dx
+  mov %ax, %bx
+  and $15, %bx
+  mov %bx, %cs:end_offset
+  mov $4, %cx
+2:
+  shr %dx
+  rcr %ax
+  loop 2b
+  mov %ds, %bx
+  add %bx, %ax
+  mov %ax, %cs:end_segment
+
+sequence:
+  lodsb
+  mov %al, %bl                      # Token
+  xor %cx, %cx
+  mov %bl, %cl
+  shr $4, %cl
+  call read_length
+  rep movsb                         # Literals
+  call normalize
+
+  # The last sequence ends with its literals
+  mov %ds, %ax
+  cmp %cs:end_segment, %ax
+  jne 3f
+  cmp %cs:end_offset, %si
+  je done
+3:
+  lodsw
+  mov %ax, %dx                      # Match offset
+  test %dx, %dx
+  jz sequence
+  xor %cx, %cx
+  mov %bl, %cl
+  and $15, %cl
+  call read_length
+  add $4, %cx
+  call copy_match
+  jmp sequence
+
+done:
+  # Zero the BSS from es:di, a paragraph at a time
+  mov %cs:bss_paragraphs, %bx
+  xor %ax, %ax
+  test %bx, %bx
+  jz enter_kernel
+4:
+  mov $8, %cx
+  rep stosw
+  sub $16, %di
+  mov %es, %dx
+  inc %dx
+  mov %dx, %es
+  dec %bx
+  jnz 4b
+
+enter_kernel:
+  mov %cs:kernel_segment, %ax
+  mov %ax, %ds
+  mov %ax, %es
+  push %ax
+  push %cs:kernel_entry
+  lret
+
+# Adds the length extension that follows to cx, when cx is 15
+read_length:
+  cmp $15, %cx
+  jne 6f
+5:
+  lodsb
+  xor %ah, %ah
+  add %ax, %cx
+  cmp $255, %al
+  je 5b
+6:
+  ret
+
+# Copies cx bytes from dx bytes behind es:di to es:di, one byte at a time
+# since the source may overlap what is being written
+copy_match:
+  push %ds
+  push %si
+  mov %dx, %si
+  neg %si                           # -offset
+  add $15, %dx
+  shr $4, %dx                       # Paragraphs back, rounded up
+  mov %es, %ax
+  sub %dx, %ax
+  mov %ax, %ds
+  shl $4, %dx
+  add %dx, %si                      # Paragraphs back * 16 - offset
+  add %di, %si
+  rep movsb
+  pop %si
+  pop %ds
+  # Fall through
+
+# Brings si and di below 16, moving ds and es forward
+normalize:
+  mov %si, %ax
+  shr $4, %ax
+  mov %ds, %dx
+  add %ax, %dx
+  mov %dx, %ds
+  and $15, %si
+  mov %di, %ax
+  shr $4, %ax
+  mov %es, %dx
+  add %ax, %dx
+  mov %dx, %es
+  and $15, %di
+  ret
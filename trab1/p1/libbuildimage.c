@@ -0,0 +1,2161 @@
+/* Author(s): Samuel de Oliveira Krabbe e Leonardo de Moraes Perin
+ * Creates operating system image suitable for placement on a boot disk
+ * (libbuildimage, see buildimage.h)
+*/
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buildimage.h"
+
+#define MANIFEST_MAGIC "buildimage-manifest 3"
+#define COPY_BUFFER_SIZE (64 * 1024) /* chunk size of the read/write fallback */
+#define DIRECT_CHUNK (1024 * 1024)   /* bytes per write() of build_image_direct() */
+#define DIRECT_ALIGN 4096            /* O_DIRECT alignment for files and the buffer */
+#define ERROR_SIZE 512
+
+/* --compress puts a decompressor stub (decompress.s) right after the boot
+ * sector and the compressed kernel after it, from the next paragraph. The
+ * stub starts with a short jmp over these parameters. The stub moves
+ * itself to STUB_RELOC_LINEAR before inflating, which bounds both what it
+ * is loaded with and the kernel. */
+#define STUB_IMAGE_PARAGRAPHS 2
+#define STUB_PAYLOAD_PARAGRAPH 4
+#define STUB_PAYLOAD_SIZE 6
+#define STUB_KERNEL_SEGMENT 10
+#define STUB_KERNEL_ENTRY 12
+#define STUB_BSS_PARAGRAPHS 14
+#define STUB_PARAMS_END 16
+#define STUB_LOAD_LINEAR KERNEL_ADDR  /* Where the bootblock puts it */
+#define STUB_RELOC_LINEAR 0x60000
+#define STUB_STACK_LINEAR 0x90000  /* Where the bootblock keeps its stack */
+
+/* Limits of the LZ4-style format the stub decodes. Lengths and offsets
+ * stay clear of 64 KiB so every copy fits in a real-mode segment. */
+#define LZ4_MIN_MATCH 4
+#define LZ4_MAX_LENGTH 0xf000
+#define LZ4_MAX_OFFSET 0xfff0
+#define LZ4_HASH_BITS 12
+
+// Work shared by the --jobs threads: each takes the next item until none is left
+typedef struct {
+    int (*work)(void *item);
+    void **items;
+    int count;
+    int next;
+    int failed;
+    char error[ERROR_SIZE];     // The first failure, from whichever thread
+    pthread_mutex_t mutex;
+} WorkQueue;
+
+// Per thread, like errno
+static __thread char error_message[ERROR_SIZE];
+
+
+const char *buildimage_error(void) {
+
+    return error_message;
+}
+
+/* Records a failure for buildimage_error(). Returns -1. */
+static int fail(const char *format, ...) {
+
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(error_message, sizeof(error_message), format, args);
+    va_end(args);
+    return -1;
+}
+
+/* Same, followed by the description of errno, like perror() */
+static int fail_errno(const char *what) {
+
+    return fail("%s: %s", what, strerror(errno));
+}
+
+/* Allocates or exits */
+static void *xmalloc(size_t size) {
+
+    void *p = malloc(size);
+    if (p == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/* Allocates zeroed memory or exits */
+static void *xcalloc(size_t count, size_t size) {
+
+    void *p = calloc(count, size);
+    if (p == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/* Maps the whole input file read-only */
+static int map_file(Executable *exe) {
+
+    struct stat st;
+
+    if (fstat(exe->fd, &st) < 0)
+        return fail_errno(exe->filename);
+    if (st.st_size == 0)
+        return fail("%s is empty", exe->filename);
+
+    exe->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, exe->fd, 0);
+    if (exe->map == MAP_FAILED) {
+        exe->map = NULL;
+        return fail_errno(exe->filename);
+    }
+
+    exe->size = st.st_size;
+    return 0;
+}
+
+/* Fails unless [offset, offset + length) lies inside a mapping of /size/ bytes */
+static int check_range(size_t offset, size_t length, size_t size, const char *filename) {
+
+    if (offset > size || length > size - offset)
+        return fail("%s is truncated or not a valid ELF file", filename);
+    return 0;
+}
+
+/* Reads the ELF header and the program header table, 32 or 64-bit, keeping
+ * only the PT_LOAD segments, sorted by vaddr. A segment that maps nothing
+ * but the ELF headers (recent linkers emit one) is dropped: the loader has
+ * no use for it. */
+static int read_elf(Executable *exe) {
+
+    unsigned char *ident = exe->map;
+    uint64_t phoff, headers_end;
+    unsigned int phnum, phentsize, i, type;
+    Segment segment;
+    int j;
+
+    if (check_range(0, EI_NIDENT, exe->size, exe->filename) < 0)
+        return -1;
+    if (memcmp(ident, ELFMAG, SELFMAG) != 0)
+        return fail("%s is not an ELF file", exe->filename);
+    if (ident[EI_DATA] != ELFDATA2LSB || (ident[EI_CLASS] != ELFCLASS32 && ident[EI_CLASS] != ELFCLASS64))
+        return fail("%s is not a little-endian ELF32 or ELF64 file", exe->filename);
+    exe->elf_class = ident[EI_CLASS];
+
+    // The header is used in place, straight from the mapping
+    if (exe->elf_class == ELFCLASS32) {
+        Elf32_Ehdr *ehdr = (Elf32_Ehdr *)exe->map;
+        if (check_range(0, sizeof(Elf32_Ehdr), exe->size, exe->filename) < 0)
+            return -1;
+        exe->entry = ehdr->e_entry;
+        phoff = ehdr->e_phoff;
+        phnum = ehdr->e_phnum;
+        phentsize = ehdr->e_phentsize;
+        if (phnum > 0 && phentsize != sizeof(Elf32_Phdr))
+            phentsize = 0;
+    } else {
+        Elf64_Ehdr *ehdr = (Elf64_Ehdr *)exe->map;
+        if (check_range(0, sizeof(Elf64_Ehdr), exe->size, exe->filename) < 0)
+            return -1;
+        exe->entry = ehdr->e_entry;
+        phoff = ehdr->e_phoff;
+        phnum = ehdr->e_phnum;
+        phentsize = ehdr->e_phentsize;
+        if (phnum > 0 && phentsize != sizeof(Elf64_Phdr))
+            phentsize = 0;
+    }
+    if (phnum > 0 && phentsize == 0)
+        return fail("%s has an unexpected program header size", exe->filename);
+    if (check_range(phoff, (size_t)phnum * phentsize, exe->size, exe->filename) < 0)
+        return -1;
+    headers_end = phoff + (uint64_t)phnum * phentsize;
+
+    // One pass over the table
+    exe->segments = (Segment *)xmalloc((phnum + 1) * sizeof(Segment));
+    exe->num_segments = 0;
+    for (i = 0; i < phnum; i++) {
+        if (exe->elf_class == ELFCLASS32) {
+            Elf32_Phdr *phdr = (Elf32_Phdr *)(exe->map + phoff) + i;
+            type = phdr->p_type;
+            segment.offset = phdr->p_offset;
+            segment.vaddr = phdr->p_vaddr;
+            segment.filesz = phdr->p_filesz;
+            segment.memsz = phdr->p_memsz;
+        } else {
+            Elf64_Phdr *phdr = (Elf64_Phdr *)(exe->map + phoff) + i;
+            type = phdr->p_type;
+            segment.offset = phdr->p_offset;
+            segment.vaddr = phdr->p_vaddr;
+            segment.filesz = phdr->p_filesz;
+            segment.memsz = phdr->p_memsz;
+        }
+
+        if (type != PT_LOAD)
+            continue;
+        if (segment.offset == 0 && segment.filesz > 0 && segment.filesz == segment.memsz && segment.filesz <= headers_end)
+            continue;
+        if (check_range(segment.offset, segment.filesz, exe->size, exe->filename) < 0)
+            return -1;
+        if (segment.memsz < segment.filesz)
+            segment.memsz = segment.filesz;
+
+        // Insertion sort by vaddr, tables are a handful of entries
+        for (j = exe->num_segments; j > 0 && exe->segments[j - 1].vaddr > segment.vaddr; j--)
+            exe->segments[j] = exe->segments[j - 1];
+        exe->segments[j] = segment;
+        exe->num_segments++;
+    }
+
+    if (exe->num_segments == 0)
+        return fail("%s has no loadable segments", exe->filename);
+    for (j = 1; j < exe->num_segments; j++) {
+        if (exe->segments[j - 1].vaddr + exe->segments[j - 1].memsz > exe->segments[j].vaddr)
+            return fail("%s has overlapping segments", exe->filename);
+    }
+    return 0;
+}
+
+/* 64-bit FNV-1a */
+static uint64_t hash_bytes(const unsigned char *data, size_t length) {
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Hashes every segment, as it will appear in the image */
+static void hash_segments(Executable *exe) {
+
+    int i;
+    Segment *segment = exe->segments;
+
+    exe->hash = (uint64_t *)xmalloc(exe->num_segments * sizeof(uint64_t));
+    for (i = 0; i < exe->num_segments; i++)
+        exe->hash[i] = hash_bytes(exe->map + segment[i].offset, segment[i].filesz);
+}
+
+int load_executable(Executable *exe) {
+
+    exe->map = NULL;
+    exe->segments = NULL;
+    exe->image_offset = NULL;
+    exe->hash = NULL;
+
+    exe->fd = open(exe->filename, O_RDONLY);
+    if (exe->fd < 0)
+        return fail("Error opening %s", exe->filename);
+    if (map_file(exe) < 0 || read_elf(exe) < 0) {
+        close_executable(exe);
+        return -1;
+    }
+    hash_segments(exe);
+    return 0;
+}
+
+int load_executable_memory(Executable *exe, const char *name, const void *data, size_t size) {
+
+    exe->filename = name;
+    exe->fd = -1;
+    exe->map = (unsigned char *)data;
+    exe->size = size;
+    exe->segments = NULL;
+    exe->image_offset = NULL;
+    exe->hash = NULL;
+
+    if (size == 0)
+        return fail("%s is empty", name);
+    if (read_elf(exe) < 0) {
+        close_executable(exe);
+        return -1;
+    }
+    hash_segments(exe);
+    return 0;
+}
+
+/* Thread body for --jobs */
+static void *work_worker(void *arg) {
+
+    WorkQueue *queue = (WorkQueue *)arg;
+    int i;
+
+    for (;;) {
+        pthread_mutex_lock(&queue->mutex);
+        i = queue->next++;
+        pthread_mutex_unlock(&queue->mutex);
+
+        if (i >= queue->count)
+            return NULL;
+        if (queue->work(queue->items[i]) < 0) {
+            // The message is in this thread's buffer, hand it over
+            pthread_mutex_lock(&queue->mutex);
+            if (!queue->failed)
+                snprintf(queue->error, sizeof(queue->error), "%s", error_message);
+            queue->failed = 1;
+            pthread_mutex_unlock(&queue->mutex);
+        }
+    }
+}
+
+/* Runs work on every item, on up to /jobs/ threads. Every item is worked
+ * on even if one fails; the first failure is reported. */
+static int run_parallel(int (*work)(void *item), void **items, int count, int jobs) {
+
+    WorkQueue queue;
+    pthread_t *threads;
+    int i, started;
+
+    queue.work = work;
+    queue.items = items;
+    queue.count = count;
+    queue.next = 0;
+    queue.failed = 0;
+    pthread_mutex_init(&queue.mutex, NULL);
+
+    if (jobs > count)
+        jobs = count;
+    threads = (pthread_t *)xmalloc((jobs + 1) * sizeof(pthread_t));
+
+    // The calling thread is one of the workers
+    for (started = 0; started < jobs - 1; started++) {
+        if (pthread_create(&threads[started], NULL, work_worker, &queue) != 0)
+            break;
+    }
+    work_worker(&queue);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&queue.mutex);
+    free(threads);
+    return queue.failed ? fail("%s", queue.error) : 0;
+}
+
+static int load_item(void *item) {
+
+    return load_executable((Executable *)item);
+}
+
+int load_inputs(Package *package, int jobs) {
+
+    void **items = (void **)xmalloc((package->num_kernels + 2) * sizeof(void *));
+    int i, count = 0, status;
+
+    items[count++] = &package->boot;
+    for (i = 0; i < package->num_kernels; i++)
+        items[count++] = &package->kernels[i];
+    if (package->compress)
+        items[count++] = &package->stub;
+
+    status = run_parallel(load_item, items, count, jobs);
+    free(items);
+    return status;
+}
+
+/* Places the segments of exe by vaddr from image offset /start/, so that
+ * reading the image sectors to the lowest vaddr puts every segment where it
+ * was linked. Gaps between segments are zeros on disk, but the BSS past the
+ * last stored byte is only recorded in bss_size. Returns the offset of the
+ * sector that follows the executable. */
+static size_t layout_executable(Executable *exe, size_t start) {
+
+    int i;
+    Segment *segment = exe->segments;
+    uint64_t base = segment[0].vaddr;
+    uint64_t file_end = base, mem_end = base;
+
+    exe->image_offset = (size_t *)xmalloc(exe->num_segments * sizeof(size_t));
+    exe->image_start = start;
+    for (i = 0; i < exe->num_segments; i++) {
+        exe->image_offset[i] = start + (segment[i].vaddr - base);
+        if (segment[i].filesz > 0 && segment[i].vaddr + segment[i].filesz > file_end)
+            file_end = segment[i].vaddr + segment[i].filesz;
+        if (segment[i].vaddr + segment[i].memsz > mem_end)
+            mem_end = segment[i].vaddr + segment[i].memsz;
+    }
+    exe->image_end = start + (file_end - base + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+
+    // The loader reads whole sectors, so the BSS they cover is already zero
+    file_end = base + (exe->image_end - start);
+    exe->bss_size = mem_end > file_end ? mem_end - file_end : 0;
+
+    return exe->image_end;
+}
+
+/* Places the kernels after the boot sector (and the module table, if there
+ * is one, or on the track after the read plan) and computes the size of the
+ * image. Everything the loader is told about must fit in what the image
+ * format has room for. */
+static int layout_image(Package *package) {
+
+    Segment *boot = &package->boot.segments[0];
+    Executable *exe;
+    int i, k;
+    size_t size;
+
+    if (package->num_kernels < 1 || package->num_kernels > (int)MAX_MODULES)
+        return fail("An image holds 1 to %d executables, not %d", (int)MAX_MODULES, package->num_kernels);
+    if (package->boot.num_segments > 1 || boot->filesz > SECTOR_SIZE - 2)
+        return fail("%s does not fit in the boot sector", package->boot.filename);
+
+    package->kernel_sector = 1;
+    if (package->sectors_per_track > 0) {
+        if (package->num_kernels > 1)
+            return fail("--geometry takes a single kernel");
+        if (package->sectors_per_track < 2 || package->sectors_per_track > 63 || package->heads < 1 || package->heads > 255)
+            return fail("%d sectors per track and %d heads is not a disk geometry the BIOS reads", package->sectors_per_track, package->heads);
+        if (KERNEL_ADDR % SECTOR_SIZE != 0)
+            return fail("runs of sectors to 0x%x would cross 64 KB boundaries mid-sector", KERNEL_ADDR);
+        package->kernel_sector = package->sectors_per_track;
+    }
+    size = package->kernel_sector * SECTOR_SIZE;
+
+    if (package->num_kernels > 1)
+        size += SECTOR_SIZE;
+
+    package->total_segments = 0;
+    for (k = 0; k < package->num_kernels; k++) {
+        exe = &package->kernels[k];
+        for (i = 0; i < exe->num_segments; i++) {
+            if (exe->segments[i].vaddr + exe->segments[i].memsz > REAL_MODE_LIMIT)
+                return fail("%s: segment %d ends at 0x%" PRIx64 ", past the 1 MB a real-mode loader reaches",
+                            exe->filename, i, exe->segments[i].vaddr + exe->segments[i].memsz);
+        }
+        size = layout_executable(exe, size);
+        package->total_segments += exe->num_segments;
+        if ((exe->bss_size + 15) / 16 > 0xffff)
+            return fail("%s: the BSS does not fit in real mode memory", exe->filename);
+        if ((exe->image_end - exe->image_start) / SECTOR_SIZE > MAX_SECTORS)
+            return fail("%s: %zu sectors do not fit in the module table", exe->filename,
+                        (exe->image_end - exe->image_start) / SECTOR_SIZE);
+    }
+
+    package->image_size = size;
+    return 0;
+}
+
+/* Copies length bytes of in at in_offset to out at out_offset without
+ * bringing them into user space when the kernel can do it: copy_file_range
+ * first (a reflink on CoW filesystems), then sendfile, then a read/write
+ * loop. Each fallback picks up where the previous one stopped. Returns the
+ * name of the method that finished the copy, or NULL on failure. */
+static const char *copy_segment(int out, off_t out_offset, int in, off_t in_offset, size_t length) {
+
+    // Per thread, for --batch
+    static __thread int use_copy_file_range = 1, use_sendfile = 1;
+    unsigned char buffer[COPY_BUFFER_SIZE];
+    ssize_t n, written;
+
+    while (use_copy_file_range && length > 0) {
+        n = copy_file_range(in, &in_offset, out, &out_offset, length, 0);
+        if (n <= 0) {
+            // EXDEV, ENOSYS, EINVAL...: not supported between these files
+            use_copy_file_range = 0;
+            break;
+        }
+        length -= n;
+    }
+    if (length == 0)
+        return "copy_file_range";
+
+    if (use_sendfile && lseek(out, out_offset, SEEK_SET) < 0) {
+        fail_errno("Error seeking imagefile");
+        return NULL;
+    }
+    while (use_sendfile && length > 0) {
+        n = sendfile(out, in, &in_offset, length);
+        if (n <= 0) {
+            use_sendfile = 0;
+            break;
+        }
+        out_offset += n;
+        length -= n;
+    }
+    if (length == 0)
+        return "sendfile";
+
+    while (length > 0) {
+        n = pread(in, buffer, length < COPY_BUFFER_SIZE ? length : COPY_BUFFER_SIZE, in_offset);
+        if (n <= 0) {
+            fail("Error reading kernel segment");
+            return NULL;
+        }
+        for (written = 0; written < n; ) {
+            ssize_t w = pwrite(out, buffer + written, n - written, out_offset + written);
+            if (w < 0) {
+                fail_errno("Error writing imagefile");
+                return NULL;
+            }
+            written += w;
+        }
+        in_offset += n;
+        out_offset += n;
+        length -= n;
+    }
+    return "read/write";
+}
+
+/* Writes the bootblock to image */
+static void write_bootblock(Package *package) {
+
+    Executable *boot = &package->boot;
+    Segment *segment = &boot->segments[0];
+
+    // Copy the bootblock straight from its mapping. The padding up to the
+    // signature is already zero in a new image, and an incremental build
+    // only gets here for a bootblock of the same size.
+    memcpy(package->image_map, boot->map + segment->offset, segment->filesz);
+    package->boot_written = 1;
+
+    // Write the boot signature (aa55) to the last two bytes
+    unsigned short boot_signature = 0xaa55;
+    memcpy(package->image_map + BOOTLOADER_SIG_OFFSET, &boot_signature, sizeof(unsigned short));
+}
+
+/* Writes segment i of a kernel to image: with copy_segment() from file to
+ * file, straight from the mapping when either end is in memory */
+static int write_kernel_segment(Package *package, Executable *exe, int i) {
+
+    Segment *segment = &exe->segments[i];
+
+    if (segment->filesz > 0 && package->imagefile >= 0 && exe->fd >= 0) {
+        package->copy_method = copy_segment(package->imagefile, exe->image_offset[i], exe->fd, segment->offset, segment->filesz);
+        if (package->copy_method == NULL)
+            return -1;
+    } else if (segment->filesz > 0) {
+        memcpy(package->image_map + exe->image_offset[i], exe->map + segment->offset, segment->filesz);
+        package->copy_method = "memcpy";
+    }
+    package->segments_written++;
+    return 0;
+}
+
+/* Writes the kernels to image */
+static int write_kernel(Package *package) {
+
+    int i, k;
+    Executable *exe;
+
+    // Copy each segment from its file into imagefile. The image was sized
+    // with ftruncate(), so the gaps between segments are holes that read
+    // back as zeros and are never written.
+    for (k = 0; k < package->num_kernels; k++) {
+        exe = &package->kernels[k];
+        for (i = 0; i < exe->num_segments; i++) {
+            if (write_kernel_segment(package, exe, i) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+unsigned short bss_paragraphs(const Executable *exe) {
+
+    // layout_image() made sure it fits
+    return (unsigned short)((exe->bss_size + 15) / 16);
+}
+
+/* Writes the module table of a multi-kernel image */
+static void write_module_table(Package *package) {
+
+    unsigned char *table = package->image_map + MODULE_TABLE_SECTOR * SECTOR_SIZE;
+    module_table_header_t header;
+    module_entry_t entry;
+    Executable *exe;
+    int k;
+
+    if (package->num_kernels < 2)
+        return;
+
+    memset(table, 0, SECTOR_SIZE);
+    header.magic = MODULE_TABLE_MAGIC;
+    header.count = package->num_kernels;
+    header.reserved = 0;
+    memcpy(table, &header, sizeof(header));
+
+    for (k = 0; k < package->num_kernels; k++) {
+        exe = &package->kernels[k];
+        entry.sector = exe->image_start / SECTOR_SIZE;
+        // layout_image() made sure it fits
+        entry.num_sectors = (exe->image_end - exe->image_start) / SECTOR_SIZE;
+        entry.bss_paragraphs = bss_paragraphs(exe);
+        entry.entry = exe->entry;
+        entry.load_vaddr = exe->segments[0].vaddr;
+        memcpy(table + sizeof(header) + k * sizeof(entry), &entry, sizeof(entry));
+    }
+}
+
+/* Counts the number of sectors in the kernel */
+static void count_kernel_sectors(Package *package) {
+
+    // The loader reads everything after the boot sector: the kernel, or the
+    // module table and every module. The read plan is not counted.
+    // prepare_image() made sure it fits.
+    package->num_kernel_sectors = (unsigned short)(package->image_size / SECTOR_SIZE - package->kernel_sector);
+}
+
+/* Writes the read plan of an image with a geometry */
+static void write_read_plan(Package *package) {
+
+    unsigned char *sector = package->image_map + READ_PLAN_SECTOR * SECTOR_SIZE;
+    read_plan_header_t header;
+
+    if (package->plan == NULL)
+        return;
+
+    memset(sector, 0, SECTOR_SIZE);
+    header.magic = READ_PLAN_MAGIC;
+    header.count = package->plan_runs;
+    header.sectors_per_track = package->sectors_per_track;
+    header.heads = package->heads;
+    memcpy(sector, &header, sizeof(header));
+    memcpy(sector + sizeof(header), package->plan, package->plan_runs * sizeof(read_run_t));
+}
+
+
+/* Records the number of sectors in the kernel to 2nd position in image,
+ * followed by the BSS of a single kernel (modules keep theirs in the table) */
+static void record_kernel_sectors(Package *package) {
+
+    unsigned short bss = 0;
+
+    // Write os_size into 2nd position of image
+    memcpy(package->image_map + OS_SIZE_OFFSET, &package->num_kernel_sectors, 2);
+
+    // The stub of a compressed image zeroes the BSS itself
+    if (package->num_kernels == 1 && !package->compress)
+        bss = bss_paragraphs(&package->kernels[0]);
+    memcpy(package->image_map + BSS_PARAGRAPHS_OFFSET, &bss, 2);
+}
+
+/* The module table and os_size, rewritten on every build: they are tiny */
+static void finish_image(Package *package) {
+
+    write_module_table(package);
+    count_kernel_sectors(package);
+    record_kernel_sectors(package);
+    write_read_plan(package);
+}
+
+/* Maps the whole image read/write */
+static int map_image(Package *package) {
+
+    package->image_map = mmap(NULL, package->image_size, PROT_READ | PROT_WRITE, MAP_SHARED, package->imagefile, 0);
+    if (package->image_map == MAP_FAILED) {
+        package->image_map = NULL;
+        return fail_errno("Error mapping imagefile");
+    }
+    return 0;
+}
+
+/* The manifest records, for the last image built, its size and modification
+ * time and the offset, size and hash of the bootblock and of every kernel
+ * segment:
+ *
+ *   buildimage-manifest 3
+ *   image <size> <mtime sec> <mtime nsec>
+ *   boot <filesz> <hash>
+ *   kernels <count>
+ *   segments <count>                   (then, for each kernel)
+ *   <image offset> <filesz> <hash>     (one line per segment)
+ *
+ * Writes it next to the image, replacing the old one atomically. Without
+ * it, the next build just rewrites the whole image. */
+static void write_manifest(Package *package) {
+
+    int i, k;
+    struct stat st;
+    Executable *exe;
+    char filename[PATH_MAX], tmp[PATH_MAX];
+    FILE *manifest;
+
+    snprintf(filename, sizeof(filename), "%s" MANIFEST_SUFFIX, package->image_filename);
+    snprintf(tmp, sizeof(tmp), "%s" MANIFEST_SUFFIX ".tmp", package->image_filename);
+    if (fstat(package->imagefile, &st) < 0)
+        return;
+    manifest = fopen(tmp, "w");
+    if (manifest == NULL)
+        return;
+
+    fprintf(manifest, "%s\n", MANIFEST_MAGIC);
+    fprintf(manifest, "image %zu %ld %ld\n", package->image_size, (long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    fprintf(manifest, "boot %" PRIu64 " %016llx\n", package->boot.segments[0].filesz, (unsigned long long)package->boot.hash[0]);
+    fprintf(manifest, "kernels %d\n", package->num_kernels);
+    for (k = 0; k < package->num_kernels; k++) {
+        exe = &package->kernels[k];
+        fprintf(manifest, "segments %d\n", exe->num_segments);
+        for (i = 0; i < exe->num_segments; i++) {
+            fprintf(manifest, "%zu %" PRIu64 " %016llx\n", exe->image_offset[i], exe->segments[i].filesz, (unsigned long long)exe->hash[i]);
+        }
+    }
+
+    if (fclose(manifest) != 0 || rename(tmp, filename) < 0)
+        unlink(tmp);
+}
+
+/* Updates the existing image in place when the manifest shows the same
+ * layout: only the bootblock and the kernel segments whose hash changed are
+ * rewritten. Returns 0, without touching anything, when the image has to be
+ * rebuilt from scratch (no manifest, layout changed, image modified or
+ * missing), and -1 if rewriting a segment failed. */
+static int update_image(Package *package) {
+
+    FILE *manifest;
+    struct stat st;
+    char magic[64], filename[PATH_MAX];
+    size_t image_size, offset;
+    long mtime_sec, mtime_nsec;
+    uint64_t boot_filesz, filesz;
+    unsigned long long hash, boot_hash;
+    int i, k, n, count, ok, fd;
+    Executable *exe;
+    char *changed;
+
+    snprintf(filename, sizeof(filename), "%s" MANIFEST_SUFFIX, package->image_filename);
+    manifest = fopen(filename, "r");
+    if (manifest == NULL)
+        return 0;
+
+    // One flag per kernel segment, in image order
+    changed = (char *)calloc(package->total_segments + 1, 1);
+    if (changed == NULL) {
+        fclose(manifest);
+        return 0;
+    }
+
+    ok = fgets(magic, sizeof(magic), manifest) != NULL && !strncmp(magic, MANIFEST_MAGIC, strlen(MANIFEST_MAGIC))
+        && fscanf(manifest, " image %zu %ld %ld", &image_size, &mtime_sec, &mtime_nsec) == 3
+        && fscanf(manifest, " boot %" SCNu64 " %llx", &boot_filesz, &boot_hash) == 2
+        && fscanf(manifest, " kernels %d", &count) == 1
+        && image_size == package->image_size
+        && boot_filesz == package->boot.segments[0].filesz
+        && count == package->num_kernels;
+    for (k = 0, n = 0; ok && k < package->num_kernels; k++) {
+        exe = &package->kernels[k];
+        ok = fscanf(manifest, " segments %d", &count) == 1 && count == exe->num_segments;
+        for (i = 0; ok && i < exe->num_segments; i++, n++) {
+            ok = fscanf(manifest, " %zu %" SCNu64 " %llx", &offset, &filesz, &hash) == 3
+                && offset == exe->image_offset[i]
+                && filesz == exe->segments[i].filesz;
+            changed[n] = hash != exe->hash[i];
+        }
+    }
+    fclose(manifest);
+
+    // The image must be the one the manifest describes
+    fd = ok ? open(package->image_filename, O_RDWR) : -1;
+    if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size != image_size
+        || st.st_mtim.tv_sec != mtime_sec || st.st_mtim.tv_nsec != mtime_nsec) {
+        if (fd >= 0)
+            close(fd);
+        free(changed);
+        return 0;
+    }
+
+    package->imagefile = fd;
+    if (map_image(package) < 0) {
+        close(fd);
+        package->imagefile = -1;
+        free(changed);
+        return 0;
+    }
+    package->incremental = 1;
+
+    if (boot_hash != package->boot.hash[0])
+        write_bootblock(package);
+    for (k = 0, n = 0; k < package->num_kernels; k++) {
+        exe = &package->kernels[k];
+        for (i = 0; i < exe->num_segments; i++, n++) {
+            if (changed[n] && write_kernel_segment(package, exe, i) < 0) {
+                free(changed);
+                return -1;
+            }
+        }
+    }
+
+    free(changed);
+    return 1;
+}
+
+/* Writes an LZ4 length extension: 255s, then what is left */
+static unsigned char *lz4_length(unsigned char *out, size_t length) {
+
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = (unsigned char)length;
+    return out;
+}
+
+/* Writes one sequence: num_literals literals, then a match of length bytes
+ * at offset bytes back. A match of length 0 is written with offset 0 (a
+ * sequence with literals only), unless it is the last sequence, which has
+ * no offset at all. */
+static unsigned char *lz4_sequence(unsigned char *out, const unsigned char *literals, size_t num_literals,
+                                   size_t offset, size_t length, int last) {
+
+    unsigned char *token = out++;
+    size_t match = length > 0 ? length - LZ4_MIN_MATCH : 0;
+
+    *token = (num_literals < 15 ? num_literals : 15) << 4 | (match < 15 ? match : 15);
+    if (num_literals >= 15)
+        out = lz4_length(out, num_literals - 15);
+    memcpy(out, literals, num_literals);
+    out += num_literals;
+    if (last)
+        return out;
+
+    *out++ = offset & 0xff;
+    *out++ = offset >> 8;
+    if (length > 0 && match >= 15)
+        out = lz4_length(out, match - 15);
+    return out;
+}
+
+/* Compresses n bytes of in into out, which has room for lz4_bound(n)
+ * bytes, with a greedy search over a hash of the last 4-byte sequences.
+ * Returns the compressed size. */
+static size_t lz4_compress(const unsigned char *in, size_t n, unsigned char *out) {
+
+    static __thread long table[1 << LZ4_HASH_BITS];
+    unsigned char *end = out;
+    size_t pos = 0, anchor = 0, length;
+    uint32_t sequence, candidate;
+    long match;
+    int i;
+
+    for (i = 0; i < (1 << LZ4_HASH_BITS); i++)
+        table[i] = -1;
+
+    while (pos + LZ4_MIN_MATCH <= n) {
+        memcpy(&sequence, in + pos, sizeof(sequence));
+        i = (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+        match = table[i];
+        table[i] = pos;
+
+        if (match < 0 || pos - match > LZ4_MAX_OFFSET) {
+            pos++;
+            continue;
+        }
+        memcpy(&candidate, in + match, sizeof(candidate));
+        if (candidate != sequence) {
+            pos++;
+            continue;
+        }
+
+        for (length = LZ4_MIN_MATCH; pos + length < n && length < LZ4_MAX_LENGTH; length++) {
+            if (in[match + length] != in[pos + length])
+                break;
+        }
+        while (pos - anchor > LZ4_MAX_LENGTH) {
+            end = lz4_sequence(end, in + anchor, LZ4_MAX_LENGTH, 0, 0, 0);
+            anchor += LZ4_MAX_LENGTH;
+        }
+        end = lz4_sequence(end, in + anchor, pos - anchor, pos - match, length, 0);
+        pos += length;
+        anchor = pos;
+    }
+
+    while (n - anchor > LZ4_MAX_LENGTH) {
+        end = lz4_sequence(end, in + anchor, LZ4_MAX_LENGTH, 0, 0, 0);
+        anchor += LZ4_MAX_LENGTH;
+    }
+    end = lz4_sequence(end, in + anchor, n - anchor, 0, 0, 1);
+
+    return end - out;
+}
+
+/* Worst case of lz4_compress(): everything literal */
+static size_t lz4_bound(size_t n) {
+
+    return n + n / 255 + (n / LZ4_MAX_LENGTH + 1) * 8;
+}
+
+/* Where the payload starts in a compressed image: the paragraph after the stub */
+static size_t payload_start(const Package *package) {
+
+    return package->kernel_sector * SECTOR_SIZE + (package->stub.segments[0].filesz + 15) / 16 * 16;
+}
+
+/* Compresses the kernel as it would be laid out in an uncompressed image,
+ * and sizes the image: the boot sector, the stub and the payload, padded
+ * to a sector */
+static int compress_kernel(Package *package) {
+
+    Executable *kernel = &package->kernels[0];
+    Executable *stub = &package->stub;
+    Segment *code = &stub->segments[0];
+    uint64_t base = kernel->segments[0].vaddr;
+    size_t span = kernel->image_end - kernel->image_start;
+    unsigned char *kernel_image;
+    int i;
+
+    if (package->num_kernels > 1)
+        return fail("--compress takes a single kernel");
+    if (stub->num_segments > 1 || code->filesz < STUB_PARAMS_END || stub->map[code->offset] != 0xeb)
+        return fail("%s is not a decompressor stub", stub->filename);
+    if (base % 16 != 0 || kernel->entry < base || kernel->entry - base > 0xffff
+        || base + span + kernel->bss_size > STUB_RELOC_LINEAR)
+        return fail("%s cannot be loaded by %s", kernel->filename, stub->filename);
+
+    kernel_image = (unsigned char *)xcalloc(span, 1);
+    package->payload = (unsigned char *)xmalloc(lz4_bound(span));
+    for (i = 0; i < kernel->num_segments; i++)
+        memcpy(kernel_image + (kernel->image_offset[i] - kernel->image_start), kernel->map + kernel->segments[i].offset, kernel->segments[i].filesz);
+
+    package->kernel_span = span;
+    package->payload_size = lz4_compress(kernel_image, span, package->payload);
+    package->image_size = (payload_start(package) + package->payload_size + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    free(kernel_image);
+
+    if (STUB_RELOC_LINEAR + package->image_size - package->kernel_sector * SECTOR_SIZE > STUB_STACK_LINEAR)
+        return fail("%s is too large for %s even compressed", kernel->filename, stub->filename);
+    return 0;
+}
+
+/* Writes the stub, with its parameters filled in, and the payload */
+static void write_payload(Package *package) {
+
+    Executable *kernel = &package->kernels[0];
+    Executable *stub = &package->stub;
+    Segment *code = &stub->segments[0];
+    uint64_t base = kernel->segments[0].vaddr;
+    size_t start = package->kernel_sector * SECTOR_SIZE;
+    unsigned char *params = package->image_map + start;
+    uint16_t value16;
+    uint32_t value32;
+
+    memcpy(package->image_map + start, stub->map + code->offset, code->filesz);
+    memcpy(package->image_map + payload_start(package), package->payload, package->payload_size);
+
+    // Stub parameters, little-endian like os_size
+    value16 = (package->image_size - start) / 16;
+    memcpy(params + STUB_IMAGE_PARAGRAPHS, &value16, 2);
+    value16 = (payload_start(package) - start) / 16;
+    memcpy(params + STUB_PAYLOAD_PARAGRAPH, &value16, 2);
+    value32 = package->payload_size;
+    memcpy(params + STUB_PAYLOAD_SIZE, &value32, 4);
+    value16 = base / 16;
+    memcpy(params + STUB_KERNEL_SEGMENT, &value16, 2);
+    value16 = kernel->entry - base;
+    memcpy(params + STUB_KERNEL_ENTRY, &value16, 2);
+    value16 = bss_paragraphs(kernel);
+    memcpy(params + STUB_BSS_PARAGRAPHS, &value16, 2);
+}
+
+/* Splits what the loader reads to KERNEL_ADDR into the fewest int 13h
+ * calls the geometry allows: each run goes to the end of its track, unless
+ * its memory would cross a 64 KB boundary first. The kernel starts on a
+ * track, so every run but those cut by a boundary reads a whole track. */
+static int plan_reads(Package *package) {
+
+    size_t lba = package->kernel_sector;
+    size_t end = package->image_size / SECTOR_SIZE;
+    size_t sectors = package->sectors_per_track, heads = package->heads;
+    size_t to = KERNEL_ADDR;
+    size_t count, cylinder, sector;
+    read_run_t *run;
+
+    if (end > 1024 * heads * sectors)
+        return fail("the image takes %zu sectors, past the 1024 cylinders the BIOS addresses", end);
+
+    package->plan = (read_run_t *)xmalloc(MAX_READ_RUNS * sizeof(read_run_t));
+    package->plan_runs = 0;
+    for (; lba < end; lba += count, to += count * SECTOR_SIZE) {
+        if (package->plan_runs == (int)MAX_READ_RUNS)
+            return fail("the read plan takes more than the %d runs that fit in a sector", (int)MAX_READ_RUNS);
+        count = sectors - lba % sectors;
+        if (count > end - lba)
+            count = end - lba;
+        if (count > (0x10000 - to % 0x10000) / SECTOR_SIZE)
+            count = (0x10000 - to % 0x10000) / SECTOR_SIZE;
+
+        cylinder = lba / (sectors * heads);
+        sector = lba % sectors + 1;
+        run = &package->plan[package->plan_runs++];
+        run->cx = (uint16_t)((cylinder & 0xff) << 8 | (cylinder >> 2 & 0xc0) | sector);
+        run->dh = (uint8_t)(lba / sectors % heads);
+        run->al = (uint8_t)count;
+        run->es = (uint16_t)(to / 16);
+    }
+    return 0;
+}
+
+int prepare_image(Package *package) {
+
+    release_image(package);
+    if (layout_image(package) < 0)
+        return -1;
+    if (package->compress && compress_kernel(package) < 0)
+        return -1;
+    if (package->sectors_per_track > 0 && plan_reads(package) < 0)
+        return -1;
+    // After compression, which changes the size
+    if (package->image_size / SECTOR_SIZE - package->kernel_sector > MAX_SECTORS)
+        return fail("The image needs %zu sectors after the boot sector, os_size holds at most %d",
+                    package->image_size / SECTOR_SIZE - package->kernel_sector, MAX_SECTORS);
+    return 0;
+}
+
+void release_image(Package *package) {
+
+    int k;
+
+    for (k = 0; k < package->num_kernels; k++) {
+        free(package->kernels[k].image_offset);
+        package->kernels[k].image_offset = NULL;
+    }
+    free(package->payload);
+    free(package->plan);
+    package->payload = NULL;
+    package->plan = NULL;
+    package->plan_runs = 0;
+    package->image_size = 0;
+}
+
+/* Writes the whole image to image_map, which reads as zeros */
+static int write_image(Package *package) {
+
+    write_bootblock(package);
+    if (package->compress)
+        write_payload(package);
+    else if (write_kernel(package) < 0)
+        return -1;
+    finish_image(package);
+    return 0;
+}
+
+int build_image_buffer(Package *package, void *buffer, size_t capacity) {
+
+    int status;
+
+    if (package->image_size == 0 && prepare_image(package) < 0)
+        return -1;
+    if (capacity < package->image_size)
+        return fail("the image takes %zu bytes, the buffer holds %zu", package->image_size, capacity);
+
+    memset(buffer, 0, package->image_size);
+    package->imagefile = -1;
+    package->image_map = (unsigned char *)buffer;
+    status = write_image(package);
+    package->image_map = NULL;
+    return status;
+}
+
+/* Writes the image to the regular file package->imagefile, sized and
+ * mapped. The mapping is left to the caller. */
+static int write_image_file(Package *package) {
+
+    // Size the image up front: whatever is not written stays a zero-filled hole
+    if (ftruncate(package->imagefile, 0) < 0 || ftruncate(package->imagefile, package->image_size) < 0)
+        return fail_errno("Error sizing imagefile");
+    if (map_image(package) < 0)
+        return -1;
+    return write_image(package);
+}
+
+int build_image_fd(Package *package, int fd) {
+
+    struct stat st;
+    unsigned char *buffer;
+    size_t written;
+    ssize_t n;
+    int status, flags;
+
+    if (package->image_size == 0 && prepare_image(package) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || (flags = fcntl(fd, F_GETFL)) < 0)
+        return fail_errno("Error writing imagefile");
+
+    // Mapped in place, like build_image() does, when it can be
+    if (S_ISREG(st.st_mode) && (flags & O_ACCMODE) == O_RDWR) {
+        package->imagefile = fd;
+        status = write_image_file(package);
+        if (package->image_map != NULL)
+            munmap(package->image_map, package->image_size);
+        package->image_map = NULL;
+        package->imagefile = -1;
+        return status;
+    }
+
+    // A pipe, a socket or a write-only file: build in memory, then send it all
+    buffer = (unsigned char *)xmalloc(package->image_size);
+    status = build_image_buffer(package, buffer, package->image_size);
+    for (written = 0; status == 0 && written < package->image_size; written += n) {
+        n = write(fd, buffer + written, package->image_size - written);
+        if (n < 0 && errno == EINTR)
+            n = 0;
+        else if (n < 0)
+            status = fail_errno("Error writing imagefile");
+    }
+    free(buffer);
+    return status;
+}
+
+/* Builds the image in an aligned buffer and writes it to fd, for
+ * build_image_direct() */
+static int write_direct(Package *package, int fd, const char *path, DirectWrite *w) {
+
+    struct stat st;
+    unsigned char *buffer;
+    size_t block = DIRECT_ALIGN, padded, chunk;
+    uint64_t capacity;
+    ssize_t n;
+    int status, sector_size;
+
+    if (fstat(fd, &st) < 0)
+        return fail_errno(path);
+    if (S_ISBLK(st.st_mode)) {
+        // Writes must be whole logical blocks of the device
+        if (ioctl(fd, BLKSSZGET, &sector_size) == 0 && sector_size > 0)
+            block = sector_size;
+        if (ioctl(fd, BLKGETSIZE64, &capacity) == 0 && capacity < package->image_size)
+            return fail("%s holds %" PRIu64 " bytes, the image takes %zu", path, capacity, package->image_size);
+    } else if (!S_ISREG(st.st_mode)) {
+        return fail("%s is not a block device or a regular file", path);
+    }
+
+    padded = (package->image_size + block - 1) / block * block;
+    if (posix_memalign((void **)&buffer, block > DIRECT_ALIGN ? block : DIRECT_ALIGN, padded) != 0)
+        return fail("Error allocating a %zu-byte aligned buffer", padded);
+    memset(buffer + package->image_size, 0, padded - package->image_size);
+    status = build_image_buffer(package, buffer, padded);
+
+    // Room for the whole image up front, so the writes do not allocate
+    if (status == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size < padded)
+        posix_fallocate(fd, 0, padded);
+
+    for (w->bytes = 0; status == 0 && w->bytes < padded; w->bytes += n) {
+        chunk = padded - w->bytes < DIRECT_CHUNK ? padded - w->bytes : DIRECT_CHUNK;
+        n = pwrite(fd, buffer + w->bytes, chunk, w->bytes);
+        if (n < 0 && errno == EINTR)
+            n = 0;
+        else if (n <= 0)
+            status = fail_errno(path);
+        else
+            w->writes++;
+    }
+    free(buffer);
+
+    // A file ends with the image, past the padding a block needed. One
+    // fsync for everything: O_DIRECT skips the page cache, not the disk's.
+    if (status == 0 && S_ISREG(st.st_mode) && ftruncate(fd, package->image_size) < 0)
+        status = fail_errno(path);
+    if (status == 0 && fsync(fd) < 0)
+        status = fail_errno(path);
+    return status;
+}
+
+int build_image_direct(Package *package, const char *path, DirectWrite *w) {
+
+    struct timespec start, end;
+    int fd, status;
+
+    memset(w, 0, sizeof(*w));
+    if (package->image_size == 0 && prepare_image(package) < 0)
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fd = open(path, O_WRONLY | O_DIRECT | O_CREAT, 0644);
+    w->direct = fd >= 0;
+    // Some filesystems (tmpfs) refuse O_DIRECT: the writes are the same
+    // without it, only through the page cache
+    if (fd < 0 && errno == EINVAL)
+        fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+        return fail_errno(path);
+
+    status = write_direct(package, fd, path, w);
+    if (close(fd) < 0 && status == 0)
+        status = fail_errno(path);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    w->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return status;
+}
+
+int build_image(Package *package) {
+
+    char manifest[PATH_MAX];
+    int status;
+
+    if (package->image_size == 0 && prepare_image(package) < 0)
+        return -1;
+
+    // Nothing to update in place in a compressed image: the payload
+    // changes as a whole
+    if (package->compress) {
+        snprintf(manifest, sizeof(manifest), "%s" MANIFEST_SUFFIX, package->image_filename);
+        unlink(manifest);
+    }
+
+    package->imagefile = -1;
+    status = package->compress ? 0 : update_image(package);
+    if (status == 1) {
+        finish_image(package);
+        status = 0;
+    } else if (status == 0) {
+        package->imagefile = open(package->image_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (package->imagefile < 0)
+            return fail_errno(package->image_filename);
+        status = write_image_file(package);
+    }
+
+    // The manifest must see the final modification time of the image
+    if (status == 0 && msync(package->image_map, package->image_size, MS_SYNC) < 0)
+        status = fail_errno("Error syncing imagefile");
+    if (status == 0 && !package->compress)
+        write_manifest(package);
+
+    if (package->image_map != NULL)
+        munmap(package->image_map, package->image_size);
+    close(package->imagefile);
+    package->image_map = NULL;
+    package->imagefile = -1;
+    return status;
+}
+
+
+long lz4_decompress(const unsigned char *in, size_t n, unsigned char *out, size_t capacity) {
+
+    size_t pos = 0, written = 0, length, offset;
+    unsigned char token;
+
+    while (pos < n) {
+        token = in[pos++];
+
+        length = token >> 4;
+        if (length == 15) {
+            do {
+                if (pos >= n)
+                    return -1;
+                length += in[pos];
+            } while (in[pos++] == 255);
+        }
+        if (length > n - pos || length > capacity - written)
+            return -1;
+        memcpy(out + written, in + pos, length);
+        pos += length;
+        written += length;
+
+        // The last sequence ends with its literals
+        if (pos == n)
+            break;
+        if (n - pos < 2)
+            return -1;
+        offset = in[pos] | in[pos + 1] << 8;
+        pos += 2;
+        if (offset == 0)
+            continue;
+
+        length = token & 15;
+        if (length == 15) {
+            do {
+                if (pos >= n)
+                    return -1;
+                length += in[pos];
+            } while (in[pos++] == 255);
+        }
+        length += LZ4_MIN_MATCH;
+        if (offset > written || length > capacity - written)
+            return -1;
+        // Byte by byte: the match may overlap what it produces
+        for (; length > 0; length--, written++)
+            out[written] = out[written - offset];
+    }
+
+    return written;
+}
+
+/* Appends a message to a list of errors */
+static void add_error(char ***errors, int *num_errors, const char *format, va_list args) {
+
+    char *message;
+
+    if (vasprintf(&message, format, args) < 0)
+        message = NULL;
+
+    *errors = (char **)realloc(*errors, (*num_errors + 1) * sizeof(char *));
+    if (*errors == NULL || message == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    (*errors)[(*num_errors)++] = message;
+}
+
+/* Records a verification failure */
+static void verify_error(Verification *v, const char *format, ...) {
+
+    va_list args;
+
+    va_start(args, format);
+    add_error(&v->errors, &v->num_errors, format, args);
+    va_end(args);
+}
+
+/* Counts [offset, offset + length) of the image as data in the sector map,
+ * with /mark/ as the character of the sectors it covers */
+static void verify_mark(Verification *v, size_t offset, size_t length, char mark) {
+
+    size_t sector, end;
+
+    if (offset >= v->size)
+        return;
+    if (length > v->size - offset)
+        length = v->size - offset;
+
+    for (; length > 0; offset = end) {
+        sector = offset / SECTOR_SIZE;
+        end = (sector + 1) * SECTOR_SIZE;
+        if (end > offset + length)
+            end = offset + length;
+        v->used[sector] += end - offset;
+        if (mark != '#' || v->map[sector] == '.')
+            v->map[sector] = mark;
+        length -= end - offset;
+    }
+}
+
+/* Checks segment i of exe against /bytes/, where the image holds it */
+static void verify_segment(Verification *v, Executable *exe, int i, const unsigned char *bytes, size_t available) {
+
+    SegmentCheck *check = &v->segments[v->num_segments++];
+    uint64_t offset = exe->image_offset[i] - exe->image_start;
+
+    check->filename = exe->filename;
+    check->index = i;
+    check->image_offset = exe->image_offset[i];
+    check->filesz = exe->segments[i].filesz;
+    check->expected = exe->hash[i];
+    if (check->filesz > 0 && (offset > available || check->filesz > available - offset)) {
+        check->found = ~check->expected;
+        verify_error(v, "%s segment %d is past the end of the image", exe->filename, i);
+        return;
+    }
+
+    check->found = check->filesz > 0 ? hash_bytes(bytes + offset, check->filesz) : check->expected;
+    if (check->found != check->expected)
+        verify_error(v, "%s segment %d differs from the image", exe->filename, i);
+}
+
+/* Checks the module table against the kernels */
+static void verify_module_table(Verification *v, Package *package) {
+
+    module_table_header_t header;
+    module_entry_t entry;
+    const unsigned char *table = v->image + MODULE_TABLE_SECTOR * SECTOR_SIZE;
+    Executable *exe;
+    int k;
+
+    verify_mark(v, MODULE_TABLE_SECTOR * SECTOR_SIZE, sizeof(header) + package->num_kernels * sizeof(entry), 'T');
+    memcpy(&header, table, sizeof(header));
+    if (header.magic != MODULE_TABLE_MAGIC || header.count != package->num_kernels) {
+        verify_error(v, "module table does not list %d modules", package->num_kernels);
+        return;
+    }
+
+    for (k = 0; k < package->num_kernels; k++) {
+        exe = &package->kernels[k];
+        memcpy(&entry, table + sizeof(header) + k * sizeof(entry), sizeof(entry));
+        if (entry.sector != exe->image_start / SECTOR_SIZE
+            || entry.num_sectors != (exe->image_end - exe->image_start) / SECTOR_SIZE
+            || entry.bss_paragraphs != bss_paragraphs(exe)
+            || entry.entry != (uint32_t)exe->entry
+            || entry.load_vaddr != (uint32_t)exe->segments[0].vaddr)
+            verify_error(v, "module table entry %d does not match %s", k, exe->filename);
+    }
+}
+
+/* Checks the read plan against the one the geometry calls for */
+static void verify_read_plan(Verification *v, Package *package) {
+
+    const unsigned char *sector = v->image + READ_PLAN_SECTOR * SECTOR_SIZE;
+    read_plan_header_t header;
+
+    verify_mark(v, READ_PLAN_SECTOR * SECTOR_SIZE, sizeof(header) + package->plan_runs * sizeof(read_run_t), 'P');
+    memcpy(&header, sector, sizeof(header));
+    if (header.magic != READ_PLAN_MAGIC || header.count != package->plan_runs
+        || header.sectors_per_track != package->sectors_per_track || header.heads != package->heads)
+        verify_error(v, "sector %d is not a read plan of %d runs for %d sectors per track and %d heads",
+                     READ_PLAN_SECTOR, package->plan_runs, package->sectors_per_track, package->heads);
+    else if (memcmp(sector + sizeof(header), package->plan, package->plan_runs * sizeof(read_run_t)) != 0)
+        verify_error(v, "the read plan does not match the geometry");
+}
+
+/* Checks a compressed image: the stub, its parameters, and the kernel
+ * inflated from the payload */
+static void verify_compressed(Verification *v, Package *package) {
+
+    Executable *kernel = &package->kernels[0];
+    Executable *stub = &package->stub;
+    Segment *code = &stub->segments[0];
+    size_t base = package->kernel_sector * SECTOR_SIZE;
+    const unsigned char *params = v->image + base;
+    size_t start = payload_start(package);
+    size_t span = kernel->image_end - kernel->image_start;
+    uint16_t value16;
+    uint32_t payload_size;
+    unsigned char *kernel_image;
+    long inflated;
+    int i;
+
+    if (package->num_kernels > 1 || stub->num_segments > 1 || start > v->size) {
+        verify_error(v, "not an image of %s with %s", kernel->filename, stub->filename);
+        return;
+    }
+
+    // The stub, parameters aside
+    if (memcmp(v->image + base + STUB_PARAMS_END, stub->map + code->offset + STUB_PARAMS_END, code->filesz - STUB_PARAMS_END) != 0
+        || memcmp(v->image + base, stub->map + code->offset, STUB_IMAGE_PARAGRAPHS) != 0)
+        verify_error(v, "the image does not start with %s", stub->filename);
+
+    memcpy(&value16, params + STUB_PAYLOAD_PARAGRAPH, 2);
+    if (value16 != (start - base) / 16)
+        verify_error(v, "stub payload paragraph is %u, expected %zu", value16, (start - base) / 16);
+    memcpy(&value16, params + STUB_IMAGE_PARAGRAPHS, 2);
+    if (value16 != (v->size - base) / 16)
+        verify_error(v, "stub image paragraphs is %u, expected %zu", value16, (v->size - base) / 16);
+    memcpy(&value16, params + STUB_KERNEL_SEGMENT, 2);
+    if (value16 != kernel->segments[0].vaddr / 16)
+        verify_error(v, "stub kernel segment is 0x%04x, expected 0x%04" PRIx64, value16, kernel->segments[0].vaddr / 16);
+    memcpy(&value16, params + STUB_KERNEL_ENTRY, 2);
+    if (value16 != (uint16_t)(kernel->entry - kernel->segments[0].vaddr))
+        verify_error(v, "stub kernel entry is 0x%04x, expected 0x%04" PRIx64, value16, kernel->entry - kernel->segments[0].vaddr);
+    memcpy(&value16, params + STUB_BSS_PARAGRAPHS, 2);
+    if (value16 != bss_paragraphs(kernel))
+        verify_error(v, "stub BSS is %u paragraphs, expected %u", value16, bss_paragraphs(kernel));
+
+    memcpy(&payload_size, params + STUB_PAYLOAD_SIZE, 4);
+    if (payload_size > v->size - start) {
+        verify_error(v, "stub payload size %u is past the end of the image", payload_size);
+        return;
+    }
+    verify_mark(v, base, code->filesz, 'Z');
+    verify_mark(v, start, payload_size, 'Z');
+
+    kernel_image = (unsigned char *)xmalloc(span);
+    inflated = lz4_decompress(v->image + start, payload_size, kernel_image, span);
+    if (inflated != (long)span)
+        verify_error(v, "the payload does not inflate to the %zu bytes of %s", span, kernel->filename);
+    else
+        for (i = 0; i < kernel->num_segments; i++)
+            verify_segment(v, kernel, i, kernel_image, span);
+    free(kernel_image);
+}
+
+int verify_image_buffer(Package *package, Verification *v, const void *image, size_t size) {
+
+    Executable *boot = &package->boot;
+    Executable *exe;
+    const unsigned char *bytes;
+    uint16_t signature, bss, expected_bss = 0;
+    int i, k;
+
+    memset(v, 0, sizeof(*v));
+    v->filename = package->image_filename != NULL ? package->image_filename : "image";
+    if (size < SECTOR_SIZE || size % SECTOR_SIZE != 0)
+        return fail("%s is missing or not made of whole sectors", v->filename);
+    // Laid out like the image would be, without writing it
+    if (package->image_size == 0 && prepare_image(package) < 0)
+        return -1;
+
+    v->image = (const unsigned char *)image;
+    v->size = size;
+    v->num_sectors = v->size / SECTOR_SIZE;
+    v->used = (unsigned int *)xcalloc(v->num_sectors, sizeof(unsigned int));
+    v->map = (char *)xmalloc(v->num_sectors + 1);
+    v->segments = (SegmentCheck *)xmalloc((package->total_segments + 1) * sizeof(SegmentCheck));
+    memset(v->map, '.', v->num_sectors);
+    v->map[v->num_sectors] = '\0';
+
+    // Boot sector: the bootblock, os_size and the signature
+    verify_mark(v, 0, SECTOR_SIZE, 'B');
+    memcpy(&signature, v->image + BOOTLOADER_SIG_OFFSET, 2);
+    if (signature != 0xaa55)
+        verify_error(v, "boot signature is 0x%04x, expected 0xaa55", signature);
+    // Bytes 2 to 5 are os_size and the BSS, filled in by buildimage
+    bytes = boot->map + boot->segments[0].offset;
+    if (boot->segments[0].filesz < BSS_PARAGRAPHS_OFFSET + 2 || boot->segments[0].filesz > BOOTLOADER_SIG_OFFSET
+        || memcmp(v->image, bytes, OS_SIZE_OFFSET) != 0
+        || memcmp(v->image + BSS_PARAGRAPHS_OFFSET + 2, bytes + BSS_PARAGRAPHS_OFFSET + 2, boot->segments[0].filesz - BSS_PARAGRAPHS_OFFSET - 2) != 0)
+        verify_error(v, "boot sector does not hold %s", boot->filename);
+
+    memcpy(&v->os_size, v->image + OS_SIZE_OFFSET, 2);
+    v->expected_os_size = v->num_sectors > package->kernel_sector ? v->num_sectors - package->kernel_sector : 0;
+    if (v->expected_os_size > MAX_SECTORS)
+        verify_error(v, "%zu sectors follow the boot sector, os_size holds at most %d", v->expected_os_size, MAX_SECTORS);
+    else if (v->os_size != v->expected_os_size)
+        verify_error(v, "os_size is %u, expected %zu", v->os_size, v->expected_os_size);
+
+    if (package->num_kernels == 1 && !package->compress)
+        expected_bss = bss_paragraphs(&package->kernels[0]);
+    memcpy(&bss, v->image + BSS_PARAGRAPHS_OFFSET, 2);
+    if (bss != expected_bss)
+        verify_error(v, "BSS is %u paragraphs, expected %u", bss, expected_bss);
+
+    if (package->plan != NULL && v->num_sectors > READ_PLAN_SECTOR)
+        verify_read_plan(v, package);
+    if (package->compress) {
+        verify_compressed(v, package);
+    } else {
+        if (v->size != package->image_size)
+            verify_error(v, "image is %zu bytes, expected %zu", v->size, package->image_size);
+        if (package->num_kernels > 1)
+            verify_module_table(v, package);
+        for (k = 0; k < package->num_kernels; k++) {
+            exe = &package->kernels[k];
+            for (i = 0; i < exe->num_segments; i++) {
+                verify_segment(v, exe, i, v->image + exe->image_start, v->size - exe->image_start);
+                verify_mark(v, exe->image_offset[i], exe->segments[i].filesz, '#');
+            }
+        }
+    }
+
+    // Sectors holding some data, but not only data
+    for (i = 0; (size_t)i < v->num_sectors; i++) {
+        if (v->map[i] == '#' && v->used[i] < SECTOR_SIZE)
+            v->map[i] = '+';
+    }
+
+    v->image = NULL;
+    return v->num_errors;
+}
+
+/* Maps a built image read-only. Returns NULL on failure. */
+static void *map_built_image(const char *filename, size_t *size) {
+
+    struct stat st;
+    void *image;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < SECTOR_SIZE) {
+        if (fd >= 0)
+            close(fd);
+        fail("%s is missing or not made of whole sectors", filename);
+        return NULL;
+    }
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        fail_errno("Error mapping imagefile");
+        return NULL;
+    }
+
+    *size = st.st_size;
+    return image;
+}
+
+int verify_image(Package *package, Verification *v) {
+
+    size_t size;
+    void *image;
+    int errors;
+
+    image = map_built_image(package->image_filename, &size);
+    if (image == NULL) {
+        memset(v, 0, sizeof(*v));
+        return -1;
+    }
+    errors = verify_image_buffer(package, v, image, size);
+    munmap(image, size);
+    return errors;
+}
+
+void free_verification(Verification *v) {
+
+    int i;
+
+    for (i = 0; i < v->num_errors; i++)
+        free(v->errors[i]);
+    free(v->errors);
+    free(v->used);
+    free(v->map);
+    free(v->segments);
+    memset(v, 0, sizeof(*v));
+}
+
+/* The floppy the bootblock reads: 1.44 MB, one sector per int 13h call,
+ * 18 sectors per track and 2 heads (see its read_loop) */
+#define FLOPPY_SECTORS_PER_TRACK 18
+#define FLOPPY_HEADS 2
+#define FLOPPY_CYLINDERS 80
+
+/* Real mode memory, as the BIOS and the bootblock use it */
+#define MEMORY_SIZE 0x100000
+#define BOOT_LINEAR 0x7c00          /* Where the BIOS loads the boot sector */
+#define LOADER_LINEAR 0xa00         /* Where the bootblock moves itself */
+#define UNSET_MEMORY 0xcc           /* Whatever the loader was meant to overwrite */
+#define PLAN_LINEAR 0x500           /* Where a loader keeps the read plan: free below the bootblock */
+
+/* Records a boot failure */
+static void boot_error(BootCheck *c, const char *format, ...) {
+
+    va_list args;
+
+    va_start(args, format);
+    add_error(&c->errors, &c->num_errors, format, args);
+    va_end(args);
+}
+
+/* Reads /count/ sectors of the image from lba to linear address /to/, like
+ * one int 13h call of the bootblock (or of the read plan). Fails where the
+ * real loader would fail or overwrite itself. */
+static int boot_read(BootCheck *c, const unsigned char *image, size_t size, unsigned char *memory, size_t lba, size_t count, size_t to) {
+
+    size_t end = lba + count;
+
+    c->reads++;
+    for (; lba < end; lba++, to += SECTOR_SIZE) {
+        if (lba >= c->disk_sectors) {
+            boot_error(c, "sector %zu is past the end of the disk", lba);
+            return -1;
+        }
+        if ((lba + 1) * SECTOR_SIZE > size) {
+            boot_error(c, "sector %zu is past the end of the image", lba);
+            return -1;
+        }
+        if (to < LOADER_LINEAR + SECTOR_SIZE && to + SECTOR_SIZE > LOADER_LINEAR) {
+            boot_error(c, "sector %zu lands at 0x%05zx, over the bootblock", lba, to);
+            return -1;
+        }
+        if (to + SECTOR_SIZE > STUB_STACK_LINEAR) {
+            boot_error(c, "sector %zu lands at 0x%05zx, over the bootblock's stack", lba, to);
+            return -1;
+        }
+
+        memcpy(memory + to, image + lba * SECTOR_SIZE, SECTOR_SIZE);
+        if (to < c->load_start)
+            c->load_start = to;
+        if (to + SECTOR_SIZE > c->load_end)
+            c->load_end = to + SECTOR_SIZE;
+    }
+    return 0;
+}
+
+/* Runs the read plan of an image with a geometry: reads the plan sector,
+ * then makes each call it lists, checking it against the BIOS limits.
+ * Returns 0 once os_size sectors are in place at KERNEL_ADDR. */
+static int boot_plan(BootCheck *c, Package *package, const unsigned char *image, size_t size, unsigned char *memory) {
+
+    read_plan_header_t header;
+    read_run_t run;
+    size_t sectors = package->sectors_per_track, heads = package->heads;
+    size_t cylinder, sector, lba, to, loaded = 0;
+    int i;
+
+    if (boot_read(c, image, size, memory, READ_PLAN_SECTOR, 1, PLAN_LINEAR) < 0)
+        return -1;
+    memcpy(&header, memory + PLAN_LINEAR, sizeof(header));
+    if (header.magic != READ_PLAN_MAGIC || header.count > MAX_READ_RUNS
+        || header.sectors_per_track != sectors || header.heads != heads) {
+        boot_error(c, "sector %d is not a read plan for %zu sectors per track and %zu heads", READ_PLAN_SECTOR, sectors, heads);
+        return -1;
+    }
+
+    for (i = 0; i < header.count; i++) {
+        memcpy(&run, memory + PLAN_LINEAR + sizeof(header) + i * sizeof(run), sizeof(run));
+        cylinder = (run.cx >> 8) | (size_t)(run.cx & 0xc0) << 2;
+        sector = run.cx & 0x3f;
+        to = (size_t)run.es * 16;
+        if (sector < 1 || sector > sectors || run.dh >= heads || run.al == 0 || sector + run.al - 1 > sectors) {
+            boot_error(c, "run %d reads %u sectors from sector %zu of a track of %zu", i, run.al, sector, sectors);
+            return -1;
+        }
+        if (to / 0x10000 != (to + run.al * SECTOR_SIZE - 1) / 0x10000) {
+            boot_error(c, "run %d crosses the 64 KB boundary at 0x%05zx", i, (to / 0x10000 + 1) * 0x10000);
+            return -1;
+        }
+        lba = (cylinder * heads + run.dh) * sectors + sector - 1;
+        // The kernel starts on the second track, as layout_image() puts it
+        if (lba != sectors + loaded || to != KERNEL_ADDR + loaded * SECTOR_SIZE) {
+            boot_error(c, "run %d reads sector %zu to 0x%05zx, out of order", i, lba, to);
+            return -1;
+        }
+        if (boot_read(c, image, size, memory, lba, run.al, to) < 0)
+            return -1;
+        loaded += run.al;
+    }
+    if (loaded != c->os_size) {
+        boot_error(c, "the read plan loads %zu sectors, os_size is %u", loaded, c->os_size);
+        return -1;
+    }
+    return 0;
+}
+
+/* Zeroes /paragraphs/ 16-byte paragraphs from linear address /at/, below /limit/ */
+static int boot_zero(BootCheck *c, unsigned char *memory, size_t at, unsigned int paragraphs, size_t limit) {
+
+    if (at + (size_t)paragraphs * 16 > limit) {
+        boot_error(c, "%u paragraphs of BSS from 0x%05zx run past 0x%05zx", paragraphs, at, limit);
+        return -1;
+    }
+    memset(memory + at, 0, (size_t)paragraphs * 16);
+    return 0;
+}
+
+/* Checks that every segment of exe is where it was linked, BSS zeroed */
+static void boot_check_kernel(BootCheck *c, const unsigned char *memory, Executable *exe) {
+
+    Segment *segment;
+    uint64_t j;
+    int i;
+
+    for (i = 0; i < exe->num_segments; i++) {
+        segment = &exe->segments[i];
+        c->total_segments++;
+        if (segment->vaddr + segment->memsz > MEMORY_SIZE) {
+            boot_error(c, "%s segment %d is linked past real mode memory", exe->filename, i);
+            continue;
+        }
+        if (memcmp(memory + segment->vaddr, exe->map + segment->offset, segment->filesz) != 0) {
+            boot_error(c, "%s segment %d is not at 0x%05" PRIx64 " after booting", exe->filename, i, segment->vaddr);
+            continue;
+        }
+        for (j = segment->filesz; j < segment->memsz && memory[segment->vaddr + j] == 0; j++)
+            ;
+        if (j < segment->memsz) {
+            boot_error(c, "%s segment %d: BSS at 0x%05" PRIx64 " is not zeroed", exe->filename, i, segment->vaddr + j);
+            continue;
+        }
+        c->num_segments++;
+    }
+}
+
+/* What the stub of a compressed image does once loaded: move itself and
+ * the payload to STUB_RELOC_LINEAR, inflate the kernel and zero its BSS.
+ * That is only what happens if the code loaded is the stub's, which is
+ * checked against it when it was loaded. */
+static void boot_stub(BootCheck *c, Executable *stub, unsigned char *memory) {
+
+    const unsigned char *params = memory + STUB_LOAD_LINEAR;
+    Segment *code = &stub->segments[0];
+    uint16_t image_paragraphs, payload_paragraph, segment, entry, bss;
+    uint32_t payload_size;
+    size_t kernel;
+    long inflated;
+
+    if (params[0] != 0xeb) {
+        boot_error(c, "there is no decompressor stub at 0x%05x", STUB_LOAD_LINEAR);
+        return;
+    }
+    if (stub->map != NULL && (code->filesz < STUB_PARAMS_END
+        || memcmp(params + STUB_PARAMS_END, stub->map + code->offset + STUB_PARAMS_END, code->filesz - STUB_PARAMS_END) != 0)) {
+        boot_error(c, "the code at 0x%05x is not %s", STUB_LOAD_LINEAR, stub->filename);
+        return;
+    }
+    memcpy(&image_paragraphs, params + STUB_IMAGE_PARAGRAPHS, 2);
+    memcpy(&payload_paragraph, params + STUB_PAYLOAD_PARAGRAPH, 2);
+    memcpy(&payload_size, params + STUB_PAYLOAD_SIZE, 4);
+    memcpy(&segment, params + STUB_KERNEL_SEGMENT, 2);
+    memcpy(&entry, params + STUB_KERNEL_ENTRY, 2);
+    memcpy(&bss, params + STUB_BSS_PARAGRAPHS, 2);
+
+    if (STUB_RELOC_LINEAR + (size_t)image_paragraphs * 16 > STUB_STACK_LINEAR) {
+        boot_error(c, "the stub moves %u paragraphs, over the bootblock's stack", image_paragraphs);
+        return;
+    }
+    if ((size_t)payload_paragraph * 16 + payload_size > (size_t)image_paragraphs * 16) {
+        boot_error(c, "the payload is past what the stub moves");
+        return;
+    }
+    memmove(memory + STUB_RELOC_LINEAR, memory + STUB_LOAD_LINEAR, (size_t)image_paragraphs * 16);
+
+    kernel = (size_t)segment * 16;
+    if (kernel >= STUB_RELOC_LINEAR) {
+        boot_error(c, "the kernel segment 0x%04x is over the stub", segment);
+        return;
+    }
+    inflated = lz4_decompress(memory + STUB_RELOC_LINEAR + (size_t)payload_paragraph * 16, payload_size,
+                              memory + kernel, STUB_RELOC_LINEAR - kernel);
+    if (inflated < 0) {
+        boot_error(c, "the payload does not inflate below the stub");
+        return;
+    }
+    if (boot_zero(c, memory, kernel + inflated, bss, STUB_RELOC_LINEAR) < 0)
+        return;
+    c->entry = kernel + entry;
+}
+
+/* Loads each module of a multi-kernel image on its own, where the module
+ * table says, and checks it: modules may be linked at the same address */
+static void boot_modules(BootCheck *c, Package *package, const unsigned char *image, size_t size, unsigned char *memory) {
+
+    unsigned char table[SECTOR_SIZE];
+    module_table_header_t header;
+    module_entry_t entry;
+    Executable *exe;
+    size_t j;
+    int k;
+
+    if (boot_read(c, image, size, memory, MODULE_TABLE_SECTOR, 1, KERNEL_ADDR) < 0)
+        return;
+    memcpy(table, memory + KERNEL_ADDR, SECTOR_SIZE);
+    memcpy(&header, table, sizeof(header));
+    if (header.magic != MODULE_TABLE_MAGIC || header.count != package->num_kernels) {
+        boot_error(c, "sector %d is not a module table of %d modules", MODULE_TABLE_SECTOR, package->num_kernels);
+        return;
+    }
+
+    for (k = 0; k < package->num_kernels; k++) {
+        exe = &package->kernels[k];
+        memcpy(&entry, table + sizeof(header) + k * sizeof(entry), sizeof(entry));
+        memset(memory, UNSET_MEMORY, MEMORY_SIZE);
+        if (entry.sector + entry.num_sectors > (size_t)c->os_size + 1) {
+            boot_error(c, "module %d ends past the %u sectors of os_size", k, c->os_size);
+            continue;
+        }
+        for (j = 0; j < entry.num_sectors; j++) {
+            if (boot_read(c, image, size, memory, entry.sector + j, 1, entry.load_vaddr + j * SECTOR_SIZE) < 0)
+                break;
+        }
+        if (j < entry.num_sectors
+            || boot_zero(c, memory, entry.load_vaddr + (size_t)entry.num_sectors * SECTOR_SIZE, entry.bss_paragraphs, STUB_STACK_LINEAR) < 0)
+            continue;
+        if (k == 0)
+            c->entry = entry.entry;
+        if (entry.entry != exe->entry)
+            boot_error(c, "module %d is entered at 0x%05x, the entry point of %s is 0x%05" PRIx64, k, entry.entry, exe->filename, exe->entry);
+        boot_check_kernel(c, memory, exe);
+    }
+}
+
+int boot_image_buffer(Package *package, BootCheck *c, const void *image, size_t size) {
+
+    const unsigned char *bytes = (const unsigned char *)image;
+    Executable *kernel = &package->kernels[0];
+    unsigned char *memory;
+    uint16_t signature, bss;
+    size_t lba;
+    int loaded;
+
+    memset(c, 0, sizeof(*c));
+    c->filename = package->image_filename != NULL ? package->image_filename : "image";
+    c->load_start = MEMORY_SIZE;
+    c->disk_sectors = FLOPPY_CYLINDERS * FLOPPY_HEADS * FLOPPY_SECTORS_PER_TRACK;
+    if (package->sectors_per_track > 0)
+        c->disk_sectors = (size_t)1024 * package->heads * package->sectors_per_track;
+    if (size < SECTOR_SIZE)
+        return fail("%s is shorter than a sector", c->filename);
+
+    // The BIOS boots the first sector, if it has the signature
+    memcpy(&signature, bytes + BOOTLOADER_SIG_OFFSET, 2);
+    if (signature != 0xaa55) {
+        boot_error(c, "boot signature is 0x%04x, the BIOS would not boot it", signature);
+        return c->num_errors;
+    }
+    memory = (unsigned char *)xmalloc(MEMORY_SIZE);
+    memset(memory, UNSET_MEMORY, MEMORY_SIZE);
+    memcpy(memory + BOOT_LINEAR, bytes, SECTOR_SIZE);
+
+    // The bootblock moves itself out of the way and reads os_size sectors
+    // to KERNEL_ADDR, then jumps there
+    memcpy(memory + LOADER_LINEAR, bytes, SECTOR_SIZE);
+    memcpy(&c->os_size, bytes + OS_SIZE_OFFSET, 2);
+
+    if (package->num_kernels > 1) {
+        boot_modules(c, package, bytes, size, memory);
+        free(memory);
+        return c->num_errors;
+    }
+
+    // With a geometry, the loader runs the read plan instead
+    if (package->sectors_per_track > 0) {
+        loaded = boot_plan(c, package, bytes, size, memory) == 0;
+    } else {
+        for (lba = 1; lba <= c->os_size; lba++) {
+            if (boot_read(c, bytes, size, memory, lba, 1, KERNEL_ADDR + (lba - 1) * SECTOR_SIZE) < 0)
+                break;
+        }
+        loaded = lba > c->os_size;
+    }
+    memcpy(&bss, bytes + BSS_PARAGRAPHS_OFFSET, 2);
+    if (loaded && boot_zero(c, memory, KERNEL_ADDR + (size_t)c->os_size * SECTOR_SIZE, bss, STUB_STACK_LINEAR) == 0) {
+        c->entry = KERNEL_ADDR;
+        if (package->compress)
+            boot_stub(c, &package->stub, memory);
+        if (c->num_errors == 0 && c->entry != kernel->entry)
+            boot_error(c, "control reaches 0x%05zx, the entry point of %s is 0x%05" PRIx64, c->entry, kernel->filename, kernel->entry);
+        if (c->num_errors == 0)
+            boot_check_kernel(c, memory, kernel);
+    }
+
+    free(memory);
+    return c->num_errors;
+}
+
+int boot_image(Package *package, BootCheck *c) {
+
+    size_t size;
+    void *image;
+    int errors;
+
+    image = map_built_image(package->image_filename, &size);
+    if (image == NULL) {
+        memset(c, 0, sizeof(*c));
+        return -1;
+    }
+    errors = boot_image_buffer(package, c, image, size);
+    munmap(image, size);
+    return errors;
+}
+
+void free_boot_check(BootCheck *c) {
+
+    int i;
+
+    for (i = 0; i < c->num_errors; i++)
+        free(c->errors[i]);
+    free(c->errors);
+    memset(c, 0, sizeof(*c));
+}
+
+void close_executable(Executable *exe) {
+
+    // The bytes of an input in memory belong to the caller
+    if (exe->fd >= 0) {
+        if (exe->map != NULL)
+            munmap(exe->map, exe->size);
+        close(exe->fd);
+    }
+    free(exe->segments);
+    free(exe->image_offset);
+    free(exe->hash);
+    exe->fd = -1;
+    exe->map = NULL;
+    exe->segments = NULL;
+    exe->image_offset = NULL;
+    exe->hash = NULL;
+}
+
+/* One image of a --batch list, with the inputs it is built from: the
+ * bootblock, the kernels, then the stub if it is compressed */
+typedef struct {
+    Package *package;
+    Executable **sources;
+    char *output;               // Resolved path of the image
+    int line;                   // In the list
+} BatchImage;
+
+/* --batch: inputs shared by every image of the list, each loaded once */
+typedef struct {
+    Executable **inputs;
+    int num_inputs;
+    BatchImage *images;
+    int num_images;
+} Batch;
+
+/* Returns the input called filename, adding it if it is new */
+static Executable *batch_input(Batch *batch, const char *filename) {
+
+    int i;
+
+    for (i = 0; i < batch->num_inputs; i++) {
+        if (!strcmp(batch->inputs[i]->filename, filename))
+            return batch->inputs[i];
+    }
+
+    batch->inputs = (Executable **)realloc(batch->inputs, (batch->num_inputs + 1) * sizeof(Executable *));
+    if (batch->inputs == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    batch->inputs[batch->num_inputs] = (Executable *)xcalloc(1, sizeof(Executable));
+    batch->inputs[batch->num_inputs]->filename = strdup(filename);
+    batch->inputs[batch->num_inputs]->fd = -1;
+    return batch->inputs[batch->num_inputs++];
+}
+
+/* Returns /output/ with its directory resolved, so that two names of one
+ * file compare equal whether or not it exists yet. NULL if the directory
+ * does not exist. */
+static char *batch_output_path(const char *output) {
+
+    char dir[PATH_MAX], resolved[PATH_MAX], *path;
+    const char *base = strrchr(output, '/');
+
+    if (base == NULL) {
+        strcpy(dir, ".");
+        base = output;
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", base == output ? 1 : (int)(base - output), output);
+        base++;
+    }
+    if (realpath(dir, resolved) == NULL)
+        return NULL;
+    path = (char *)xmalloc(strlen(resolved) + strlen(base) + 2);
+    sprintf(path, "%s/%s", resolved, base);
+    return path;
+}
+
+/* Reads the list into batch */
+static int read_batch(Batch *batch, const char *list) {
+
+    FILE *file = fopen(list, "r");
+    char line[4096], *words[MAX_MODULES + 5], *save, *output;
+    int n, w, k, lineno = 0;
+    Package *package;
+    BatchImage *image;
+
+    if (file == NULL)
+        return fail_errno(list);
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        lineno++;
+        n = 0;
+        words[0] = strtok_r(line, " \t\r\n", &save);
+        while (words[n] != NULL && n < (int)MAX_MODULES + 4)
+            words[++n] = strtok_r(NULL, " \t\r\n", &save);
+        if (n == 0 || words[0][0] == '#')
+            continue;
+
+        w = !strcmp(words[0], "--compress") ? 2 : 0;
+        if (n - w < 3 || n - w - 2 > (int)MAX_MODULES) {
+            fclose(file);
+            return fail("%s:%d: expected [--compress <stub>] <output> <bootblock> <executable-file> ...", list, lineno);
+        }
+        // Two threads must not write one image (and its manifest) at once
+        output = batch_output_path(words[w]);
+        if (output == NULL) {
+            fclose(file);
+            return fail("%s:%d: %s: %s", list, lineno, words[w], strerror(errno));
+        }
+        for (k = 0; k < batch->num_images; k++) {
+            if (!strcmp(batch->images[k].output, output)) {
+                free(output);
+                fclose(file);
+                return fail("%s:%d: %s is already built at line %d", list, lineno, words[w], batch->images[k].line);
+            }
+        }
+
+        batch->images = (BatchImage *)realloc(batch->images, (batch->num_images + 1) * sizeof(BatchImage));
+        if (batch->images == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        package = (Package *)xcalloc(1, sizeof(Package));
+        image = &batch->images[batch->num_images++];
+        image->package = package;
+        image->output = output;
+        image->line = lineno;
+        package->image_filename = strdup(words[w]);
+        package->compress = w > 0;
+        package->num_kernels = n - w - 2;
+        package->kernels = (Executable *)xcalloc(package->num_kernels, sizeof(Executable));
+        image->sources = (Executable **)xmalloc((package->num_kernels + 2) * sizeof(Executable *));
+
+        image->sources[0] = batch_input(batch, words[w + 1]);
+        for (k = 0; k < package->num_kernels; k++)
+            image->sources[k + 1] = batch_input(batch, words[w + 2 + k]);
+        if (package->compress)
+            image->sources[package->num_kernels + 1] = batch_input(batch, words[1]);
+    }
+    fclose(file);
+    return 0;
+}
+
+/* Builds one image of the batch, then lets go of its layout */
+static int batch_build(void *item) {
+
+    Package *package = (Package *)item;
+    int status;
+
+    status = build_image(package);
+    release_image(package);
+    return status;
+}
+
+/* Closes every input of the batch and frees every image */
+static void free_batch(Batch *batch) {
+
+    Package *package;
+    int i;
+
+    for (i = 0; i < batch->num_inputs; i++) {
+        free((char *)batch->inputs[i]->filename);
+        close_executable(batch->inputs[i]);
+        free(batch->inputs[i]);
+    }
+    for (i = 0; i < batch->num_images; i++) {
+        package = batch->images[i].package;
+        free((char *)package->image_filename);
+        free(package->kernels);
+        free(package);
+        free(batch->images[i].sources);
+        free(batch->images[i].output);
+    }
+    free(batch->images);
+    free(batch->inputs);
+}
+
+/* Each distinct input is mapped, parsed and hashed once, then the images
+ * are written on /jobs/ threads, so the time goes with the input bytes
+ * rather than with the number of images. */
+int build_batch(const char *list, int jobs, BatchSummary *summary) {
+
+    Batch batch;
+    Package *package;
+    void **items;
+    int i, k, status;
+
+    memset(&batch, 0, sizeof(batch));
+    memset(summary, 0, sizeof(*summary));
+    if (read_batch(&batch, list) < 0) {
+        free_batch(&batch);
+        return -1;
+    }
+    if (batch.num_images == 0)
+        return 0;
+
+    items = (void **)xmalloc((batch.num_inputs + batch.num_images) * sizeof(void *));
+    for (i = 0; i < batch.num_inputs; i++)
+        items[i] = batch.inputs[i];
+    status = run_parallel(load_item, items, batch.num_inputs, jobs);
+
+    // Every image gets its own copy of the parsed inputs: the mappings,
+    // segments and hashes are shared, the layout is not
+    for (i = 0; status == 0 && i < batch.num_images; i++) {
+        package = batch.images[i].package;
+        package->boot = *batch.images[i].sources[0];
+        for (k = 0; k < package->num_kernels; k++)
+            package->kernels[k] = *batch.images[i].sources[k + 1];
+        if (package->compress)
+            package->stub = *batch.images[i].sources[package->num_kernels + 1];
+        items[i] = package;
+    }
+    if (status == 0)
+        status = run_parallel(batch_build, items, batch.num_images, jobs);
+
+    summary->num_images = batch.num_images;
+    summary->num_inputs = batch.num_inputs;
+    for (i = 0; i < batch.num_inputs; i++)
+        summary->input_bytes += batch.inputs[i]->size;
+
+    free_batch(&batch);
+    free(items);
+    return status;
+}
@@ -0,0 +1,399 @@
+/*
+  Benchmark suite for the thread library. Every benchmark collects a fixed
+  number of get_timer() samples after a warm-up, and the suite prints the
+  min/median/p99/mean of each one and writes them as JSON so runs can be
+  compared across commits.
+
+  With -p, every thread's hardware counters (see thread_perf_enable()) are
+  summed over each benchmark and reported per sample too. Reading them at
+  every switch makes the cycle figures of that run a little higher.
+
+  Usage: bench [-n samples] [-o results.json] [-p]
+*/
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <threadu.h>
+#include <lock.h>
+#include <util.h>
+
+#include "bench.h"
+
+#define WARMUP		100
+#define MAX_RESULTS	32
+#define MIN_THREADS	2
+#define MAX_THREADS	1024
+#define CHANNEL_SIZE	64
+#define CHANNEL_BATCH	64
+
+static int nsamples = 10000;
+static uint64_t *samples;
+static bench_result_t results[MAX_RESULTS];
+static int nresults = 0;
+
+/* -p: counters of the threads that have finished, and of main when the
+ * benchmark started */
+static int perf_on;
+static thread_stats_t perf_sum, perf_main;
+
+static void perf_begin(void)
+{
+	if (!perf_on)
+		return;
+	memset(&perf_sum, 0, sizeof(perf_sum));
+	thread_stats(NULL, &perf_main);
+}
+
+/* Called by every benchmark thread right before it exits */
+static void perf_collect(void)
+{
+	thread_stats_t s;
+
+	if (!perf_on)
+		return;
+	thread_stats(NULL, &s);
+	perf_sum.instructions += s.instructions;
+	perf_sum.cycles += s.cycles;
+	perf_sum.llc_misses += s.llc_misses;
+	perf_sum.branch_misses += s.branch_misses;
+}
+
+static double per_sample(int64_t sum, int64_t main_now, int64_t main_then, int n)
+{
+	if (main_now < 0)
+		return -1;
+	return (double)(sum + main_now - main_then) / n;
+}
+
+static void record(const char *name, int n)
+{
+	bench_result_t *r = &results[nresults];
+	thread_stats_t now;
+
+	bench_summarize(r, name, samples, n);
+	if (perf_on && n > 0) {
+		thread_stats(NULL, &now);
+		r->has_perf = TRUE;
+		r->instructions = per_sample(perf_sum.instructions, now.instructions,
+					     perf_main.instructions, n);
+		r->cycles = per_sample(perf_sum.cycles, now.cycles, perf_main.cycles, n);
+		r->llc_misses = per_sample(perf_sum.llc_misses, now.llc_misses,
+					   perf_main.llc_misses, n);
+		r->branch_misses = per_sample(perf_sum.branch_misses, now.branch_misses,
+					      perf_main.branch_misses, n);
+	}
+	bench_print(stdout, r);
+	nresults++;
+}
+
+/* yield ping-pong: main and one thread alternate, a sample is a round trip */
+
+static volatile int pingpong_done;
+
+void *pingpong_peer(void *p)
+{
+	while (!pingpong_done)
+		thread_yield();
+	perf_collect();
+	thread_exit(0);
+	return NULL;
+}
+
+static void bench_yield(void)
+{
+	thread_t peer;
+	uint64_t t0;
+	int i;
+
+	perf_begin();
+	pingpong_done = FALSE;
+	thread_create(&peer, pingpong_peer, NULL);
+	for (i = 0; i < WARMUP + nsamples; i++) {
+		t0 = get_timer();
+		thread_yield();
+		if (i >= WARMUP)
+			samples[i - WARMUP] = get_timer() - t0;
+	}
+	pingpong_done = TRUE;
+	thread_join(&peer, NULL);
+	record("yield_pingpong", nsamples);
+}
+
+/* create/join churn: a sample is a create, the thread's run and its join */
+
+void *churn_thread(void *p)
+{
+	perf_collect();
+	thread_exit(0);
+	return NULL;
+}
+
+static void bench_create(void)
+{
+	thread_t thd;
+	uint64_t t0;
+	int i;
+
+	perf_begin();
+	for (i = 0; i < WARMUP + nsamples; i++) {
+		t0 = get_timer();
+		thread_create(&thd, churn_thread, NULL);
+		thread_join(&thd, NULL);
+		if (i >= WARMUP)
+			samples[i - WARMUP] = get_timer() - t0;
+	}
+	record("create_join", nsamples);
+}
+
+/* parked wakeup: the only green thread blocks, so the worker parks, and an
+ * OS thread unblocks it. A sample runs from thread_unblock() to the blocked
+ * thread running again. */
+
+static thread_t wakeup_target;
+static atomic_int wakeup_armed;		/* Sample the target is blocked for */
+static atomic_uint_fast64_t wakeup_t0;
+
+static void *wakeup_poster(void *p)
+{
+	struct timespec pause = {0, 20000};
+	int i;
+
+	for (i = 0; i < WARMUP + nsamples; i++) {
+		/* sleep rather than spin: the worker may need this CPU to park */
+		while (atomic_load(&wakeup_armed) != i)
+			nanosleep(&pause, NULL);
+		nanosleep(&pause, NULL);
+		atomic_store(&wakeup_t0, get_timer());
+		thread_unblock(&wakeup_target);
+	}
+	return NULL;
+}
+
+static void bench_wakeup(void)
+{
+	pthread_t poster;
+	int i;
+
+	perf_begin();
+	wakeup_target = thread_self();
+	atomic_store(&wakeup_armed, -1);
+	atomic_store(&wakeup_t0, 0);
+	pthread_create(&poster, NULL, wakeup_poster, NULL);
+	for (i = 0; i < WARMUP + nsamples; i++) {
+		atomic_store(&wakeup_armed, i);
+		/* wakeups may be spurious: wait for this sample's */
+		do {
+			thread_block();
+		} while (atomic_load(&wakeup_t0) == 0);
+		if (i >= WARMUP)
+			samples[i - WARMUP] = get_timer() - atomic_load(&wakeup_t0);
+		atomic_store(&wakeup_t0, 0);
+	}
+	pthread_join(poster, NULL);
+	record("parked_wakeup", nsamples);
+}
+
+/* lock contention: every thread takes the lock repeatedly, yielding inside
+ * the critical section now and then so the others find it taken. A sample
+ * is the latency of one lock_acquire(). */
+
+static lock_t contention_lock;
+static int contention_iters;
+static int contention_next;
+static volatile int shared_counter;
+
+void *contention_thread(void *p)
+{
+	uint64_t t0;
+	int i;
+
+	for (i = 0; i < contention_iters; i++) {
+		t0 = get_timer();
+		lock_acquire(&contention_lock);
+		samples[contention_next++] = get_timer() - t0;
+		shared_counter++;
+		if (i % 4 == 0)
+			thread_yield();
+		lock_release(&contention_lock);
+		thread_yield();
+	}
+	perf_collect();
+	thread_exit(0);
+	return NULL;
+}
+
+static void bench_lock(int nthreads)
+{
+	thread_t thd[MAX_THREADS];
+	char name[64];
+	int i;
+
+	perf_begin();
+	/* samples[] holds nsamples entries, split between the threads */
+	contention_iters = nsamples / nthreads;
+	contention_next = 0;
+	shared_counter = 0;
+	lock_init(&contention_lock);
+
+	for (i = 0; i < nthreads; i++)
+		thread_create(&thd[i], contention_thread, NULL);
+	for (i = 0; i < nthreads; i++)
+		thread_join(&thd[i], NULL);
+
+	if (shared_counter != contention_iters * nthreads)
+		fprintf(stderr, "lock_contention: lost updates (%d != %d)\n",
+			shared_counter, contention_iters * nthreads);
+	snprintf(name, sizeof(name), "lock_contention/%d", nthreads);
+	record(name, contention_next);
+}
+
+/* channel throughput: a bounded FIFO protected by a lock_t, one producer
+ * and one consumer. A sample is the cost per message of a batch. */
+
+typedef struct {
+	lock_t lock;
+	int buf[CHANNEL_SIZE];
+	int head, count;
+} channel_t;
+
+static channel_t chan;
+static int channel_messages;
+
+static void channel_send(channel_t *c, int v)
+{
+	lock_acquire(&c->lock);
+	while (c->count == CHANNEL_SIZE) {
+		lock_release(&c->lock);
+		thread_yield();
+		lock_acquire(&c->lock);
+	}
+	c->buf[(c->head + c->count) % CHANNEL_SIZE] = v;
+	c->count++;
+	lock_release(&c->lock);
+}
+
+static int channel_recv(channel_t *c)
+{
+	int v;
+
+	lock_acquire(&c->lock);
+	while (c->count == 0) {
+		lock_release(&c->lock);
+		thread_yield();
+		lock_acquire(&c->lock);
+	}
+	v = c->buf[c->head];
+	c->head = (c->head + 1) % CHANNEL_SIZE;
+	c->count--;
+	lock_release(&c->lock);
+	return v;
+}
+
+void *producer(void *p)
+{
+	int i;
+
+	for (i = 0; i < channel_messages; i++)
+		channel_send(&chan, i);
+	perf_collect();
+	thread_exit(0);
+	return NULL;
+}
+
+void *consumer(void *p)
+{
+	int *nbatches = p;
+	uint64_t t0 = get_timer();
+	int i;
+
+	for (i = 0; i < channel_messages; i++) {
+		if (channel_recv(&chan) != i) {
+			fprintf(stderr, "channel: message %d out of order\n", i);
+			break;
+		}
+		if ((i + 1) % CHANNEL_BATCH == 0) {
+			int batch = (i + 1) / CHANNEL_BATCH - 1;
+
+			if (batch >= WARMUP / CHANNEL_BATCH + 1)
+				samples[(*nbatches)++] = (get_timer() - t0) / CHANNEL_BATCH;
+			t0 = get_timer();
+		}
+	}
+	perf_collect();
+	thread_exit(0);
+	return NULL;
+}
+
+static void bench_channel(void)
+{
+	thread_t prod, cons;
+	int nbatches = 0;
+
+	perf_begin();
+	channel_messages = (nsamples + WARMUP / CHANNEL_BATCH + 1) * CHANNEL_BATCH;
+	chan.head = chan.count = 0;
+	lock_init(&chan.lock);
+
+	thread_create(&prod, producer, NULL);
+	thread_create(&cons, consumer, &nbatches);
+	thread_join(&prod, NULL);
+	thread_join(&cons, NULL);
+	record("channel_msg", nbatches);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *json = "bench.json";
+	int opt, n;
+
+	while ((opt = getopt(argc, argv, "n:o:p")) != -1) {
+		switch (opt) {
+		case 'n':
+			nsamples = atoi(optarg);
+			break;
+		case 'o':
+			json = optarg;
+			break;
+		case 'p':
+			perf_on = TRUE;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n samples] [-o results.json] [-p]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (nsamples < MAX_THREADS) {
+		fprintf(stderr, "need at least %d samples\n", MAX_THREADS);
+		exit(1);
+	}
+	samples = malloc(nsamples * sizeof(uint64_t));
+	if (samples == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	thread_init();
+	if (perf_on && thread_perf_enable() != 0) {
+		fprintf(stderr, "perf counters unavailable, running without -p\n");
+		perf_on = FALSE;
+	}
+	printf("%-24s %8s %10s %10s %10s %12s\n", "benchmark", "samples", "min",
+	       "median", "p99", "mean");
+	bench_yield();
+	bench_create();
+	bench_wakeup();
+	for (n = MIN_THREADS; n <= MAX_THREADS; n *= 2)
+		bench_lock(n);
+	bench_channel();
+
+	if (bench_write_json(json, results, nresults, nsamples) == 0)
+		printf("\nwrote %s\n", json);
+	free(samples);
+	return 0;
+}
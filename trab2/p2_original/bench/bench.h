@@ -0,0 +1,33 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Summary of one benchmark, in get_timer() cycles */
+typedef struct {
+	char name[64];
+	int samples;
+	uint64_t min;
+	uint64_t median;
+	uint64_t p99;
+	double mean;
+	/* with -p: hardware counters of every thread of the benchmark, per
+	 * sample, or -1 for a counter that could not be opened */
+	int has_perf;
+	double instructions;
+	double cycles;
+	double llc_misses;
+	double branch_misses;
+} bench_result_t;
+
+/* Sorts /samples/ in place and fills /r/ */
+void bench_summarize(bench_result_t *r, const char *name, uint64_t *samples, int n);
+
+void bench_print(FILE *out, const bench_result_t *r);
+
+/* Writes every result as one JSON document */
+int bench_write_json(const char *path, const bench_result_t *results, int n,
+		     int samples);
+
+#endif /* BENCH_H */
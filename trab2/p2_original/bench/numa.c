@@ -0,0 +1,181 @@
+/*
+  Memory-bound throughput of pinned, node-local workers against unpinned
+  ones, through the library: each worker is a process that calls
+  thread_init() and streams over its own buffer (a read and a write per
+  word) from a green thread, for a number of passes.
+
+    unpinned  THREADU_CPUS is unset, so workers float and their buffers
+              land wherever the OS first touches them
+    pinned    worker w gets THREADU_CPUS set to the CPUs of node w % nodes,
+              so thread_init() pins it there, and the buffer it takes from
+              thread_alloc() is bound to that node by worker_bind_memory()
+
+  A worker is a process because the scheduler runs one per process. Set
+  THREADU_TOPOLOGY (see topology.h) to try node layouts the machine does
+  not have; the pinning is real but the memory is not bound then.
+
+  Usage: numa [workers] [MiB per worker] [passes]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <threadu.h>
+#include <topology.h>
+
+typedef struct {
+	size_t words;
+	int ready;		/* written once the buffer is touched */
+	int go;			/* read until the parent closes it */
+} worker_t;
+
+static int passes;
+
+static void *stream(void *p)
+{
+	worker_t *w = p;
+	uint64_t *buffer = thread_alloc(w->words * sizeof(uint64_t));
+	size_t i;
+	int pass;
+	char c;
+
+	if (buffer == NULL)
+		thread_exit(1);
+	memset(buffer, 1, w->words * sizeof(uint64_t));
+	if (write(w->ready, "", 1) != 1)
+		thread_exit(1);
+	/* so that the parent sees EOF rather than waiting on a failed worker */
+	close(w->ready);
+	/* the only green thread of its worker, so blocking here is fine */
+	while (read(w->go, &c, 1) > 0)
+		;
+	for (pass = 0; pass < passes; pass++)
+		for (i = 0; i < w->words; i++)
+			buffer[i] = buffer[i] * 3 + 1;
+	thread_exit(0);
+	return NULL;
+}
+
+/* Writes the CPU list of /node/ into /buf/, such as "0,1,2,3" */
+static void node_cpus(int node, char *buf, size_t size)
+{
+	const topology_t *t = topology();
+	size_t len = 0;
+	int i;
+
+	buf[0] = '\0';
+	for (i = 0; i < t->num_cpus && len < size; i++)
+		if (t->cpu_node[i] == node)
+			len += snprintf(buf + len, size - len, "%s%d", len ? "," : "", i);
+}
+
+/* Body of worker /id/: never returns */
+static void worker(int id, int pinned, worker_t *w)
+{
+	static char cpus[8 * TOPOLOGY_MAX_CPUS];
+	thread_t t;
+	int rv, status;
+
+	if (pinned) {
+		node_cpus(id % topology()->num_nodes, cpus, sizeof(cpus));
+		setenv("THREADU_CPUS", cpus, 1);
+	} else {
+		unsetenv("THREADU_CPUS");
+	}
+	if ((rv = thread_init()) != 0 || (rv = thread_create(&t, stream, w)) != 0) {
+		fprintf(stderr, "worker %d: %s\n", id, strerror(-rv));
+		_exit(1);
+	}
+	thread_join(&t, &status);
+	_exit(status);
+}
+
+static double seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns GB/s, or a negative value if a worker failed */
+static double run(int nworkers, size_t words, int pinned)
+{
+	int ready[2], go[2];
+	worker_t w;
+	double t0, elapsed;
+	int i, status, failed = 0;
+	char c;
+
+	if (pipe(ready) < 0 || pipe(go) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+	w.words = words;
+	w.ready = ready[1];
+	w.go = go[0];
+	for (i = 0; i < nworkers; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			perror("fork");
+			exit(1);
+		}
+		if (pid == 0) {
+			close(ready[0]);
+			close(go[1]);
+			worker(i, pinned, &w);
+		}
+	}
+	close(ready[1]);
+	close(go[0]);
+
+	/* start the clock once every buffer is touched */
+	for (i = 0; i < nworkers; i++)
+		if (read(ready[0], &c, 1) != 1)
+			failed = 1;
+	t0 = seconds();
+	close(go[1]);
+	for (i = 0; i < nworkers; i++)
+		if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = 1;
+	elapsed = seconds() - t0;
+	close(ready[0]);
+
+	if (failed)
+		return -1;
+	return 2.0 * words * sizeof(uint64_t) * passes * nworkers / elapsed / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	const topology_t *t = topology();
+	int nworkers = argc > 1 ? atoi(argv[1]) : t->num_cpus;
+	size_t mib = argc > 2 ? atoi(argv[2]) : 64;
+	double unpinned, pinned;
+
+	passes = argc > 3 ? atoi(argv[3]) : 10;
+	if (nworkers < 1 || mib < 1 || passes < 1) {
+		fprintf(stderr, "Usage: %s [workers] [MiB per worker] [passes]\n", argv[0]);
+		exit(1);
+	}
+
+	printf("%d node(s)%s, %d worker(s), %zu MiB each, %d passes\n",
+	       t->num_nodes, t->synthetic ? " (THREADU_TOPOLOGY)" : "",
+	       nworkers, mib, passes);
+	unpinned = run(nworkers, mib << 17, 0);
+	pinned = run(nworkers, mib << 17, 1);
+	if (unpinned < 0 || pinned < 0) {
+		fprintf(stderr, "a worker failed\n");
+		exit(1);
+	}
+	printf("%-10s %8.2f GB/s\n", "unpinned", unpinned);
+	printf("%-10s %8.2f GB/s\n", "pinned", pinned);
+	printf("%-10s %8.2fx\n", "gain", pinned / unpinned);
+	return 0;
+}
@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile of a sorted array */
+static uint64_t percentile(const uint64_t *sorted, int n, int p)
+{
+	int rank = (p * n + 99) / 100;
+
+	if (rank < 1)
+		rank = 1;
+	return sorted[rank - 1];
+}
+
+void bench_summarize(bench_result_t *r, const char *name, uint64_t *samples, int n)
+{
+	double sum = 0;
+	int i;
+
+	memset(r, 0, sizeof(*r));
+	strncpy(r->name, name, sizeof(r->name) - 1);
+	r->samples = n;
+	if (n == 0)
+		return;
+
+	qsort(samples, n, sizeof(uint64_t), cmp_u64);
+	for (i = 0; i < n; i++)
+		sum += samples[i];
+	r->min = samples[0];
+	r->median = percentile(samples, n, 50);
+	r->p99 = percentile(samples, n, 99);
+	r->mean = sum / n;
+}
+
+void bench_print(FILE *out, const bench_result_t *r)
+{
+	fprintf(out, "%-24s %8d %10lu %10lu %10lu %12.1f\n", r->name, r->samples,
+		r->min, r->median, r->p99, r->mean);
+	if (r->has_perf)
+		fprintf(out, "%-24s instr %.1f  cycles %.1f  llc-miss %.3f  br-miss %.3f\n",
+			"", r->instructions, r->cycles, r->llc_misses, r->branch_misses);
+}
+
+int bench_write_json(const char *path, const bench_result_t *results, int n,
+		     int samples)
+{
+	FILE *f = fopen(path, "w");
+	int i;
+
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	fprintf(f, "{\n  \"unit\": \"cycles\",\n  \"timer\": \"rdtsc\",\n");
+	fprintf(f, "  \"samples_per_benchmark\": %d,\n  \"results\": [\n", samples);
+	for (i = 0; i < n; i++) {
+		fprintf(f, "    {\"name\": \"%s\", \"samples\": %d, \"min\": %lu, "
+			"\"median\": %lu, \"p99\": %lu, \"mean\": %.1f",
+			results[i].name, results[i].samples, results[i].min,
+			results[i].median, results[i].p99, results[i].mean);
+		if (results[i].has_perf)
+			fprintf(f, ", \"perf_per_sample\": {\"instructions\": %.1f, "
+				"\"cycles\": %.1f, \"llc_misses\": %.3f, "
+				"\"branch_misses\": %.3f}", results[i].instructions,
+				results[i].cycles, results[i].llc_misses,
+				results[i].branch_misses);
+		fprintf(f, "}%s\n", i + 1 < n ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+	fclose(f);
+	return 0;
+}
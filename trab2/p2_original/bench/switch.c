@@ -0,0 +1,107 @@
+/*
+  Round-robin context switch benchmark: N threads yield to each other R
+  times. Reports cycles and, when perf counters are available, cache misses
+  per switch.
+
+  Usage: switch [threads] [rounds]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <threadu.h>
+#include <util.h>
+
+static int rounds;
+
+static int open_counter(unsigned int type, unsigned long long config)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long long read_counter(int fd)
+{
+	long long value;
+
+	if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+		return -1;
+	return value;
+}
+
+void *spinner(void *p)
+{
+	int i;
+
+	for (i = 0; i < rounds; i++)
+		thread_yield();
+	thread_exit(0);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int n = argc > 1 ? atoi(argv[1]) : 100000;
+	int i, llc_fd, l1d_fd;
+	long long llc_before, llc_after, l1d_before, l1d_after;
+	uint64_t start, end;
+	double switches;
+	thread_t *thd;
+
+	rounds = argc > 2 ? atoi(argv[2]) : 10;
+	thd = malloc(n * sizeof(thread_t));
+	if (thd == NULL) {
+		perror("malloc");
+		return 1;
+	}
+
+	thread_init();
+	for (i = 0; i < n; i++) {
+		if (thread_create(&thd[i], spinner, NULL) != 0) {
+			fprintf(stderr, "thread_create failed at %d\n", i);
+			return 1;
+		}
+	}
+
+	llc_fd = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	l1d_fd = open_counter(PERF_TYPE_HW_CACHE,
+			      PERF_COUNT_HW_CACHE_L1D |
+			      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+	llc_before = read_counter(llc_fd);
+	l1d_before = read_counter(l1d_fd);
+	start = get_timer();
+
+	/* main yields once per round as well, so every thread runs in turn */
+	for (i = 0; i < n; i++)
+		thread_join(&thd[i], NULL);
+
+	end = get_timer();
+	llc_after = read_counter(llc_fd);
+	l1d_after = read_counter(l1d_fd);
+
+	/* each thread switches in once per round plus once to exit */
+	switches = (double)n * (rounds + 1);
+	printf("threads: %d, rounds: %d\n", n, rounds);
+	printf("cycles/switch: %.1f\n", (end - start) / switches);
+	if (llc_before < 0 || l1d_before < 0) {
+		printf("cache misses/switch: unavailable (perf_event_open failed)\n");
+	} else {
+		printf("LLC misses/switch: %.3f\n", (llc_after - llc_before) / switches);
+		printf("L1D misses/switch: %.3f\n", (l1d_after - l1d_before) / switches);
+	}
+	free(thd);
+	return 0;
+}
@@ -0,0 +1,8 @@
+# Settings shared by lib/, examples/ and bench/. Pass them on the command
+# line of every make, as in make LOCK_DEBUG=1.
+
+# lock_t changes layout with LOCK_DEBUG, so libt.a and everything linked
+# against it must agree on it; lock.h makes a mismatch fail to link
+ifdef LOCK_DEBUG
+LOCK_CFLAGS = -DLOCK_DEBUG
+endif
@@ -0,0 +1,121 @@
+/*
+  Spawns green threads from capturing lambdas through threadu.hpp, shares a
+  counter under green::mutex, and counts heap allocations along the way:
+  small closures must not make any.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+
+#include <threadu.hpp>
+
+static long allocations = 0;
+
+void *operator new(std::size_t size)
+{
+	allocations++;
+	if (void *p = std::malloc(size))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+#define THREADS	8
+#define ROUNDS	100
+
+int main()
+{
+	green::mutex m;
+	lock_t raw;
+	long counter = 0, sum = 0, before;
+	int i;
+
+	thread_init();
+	lock_init(&raw);
+
+	green::thread<long> threads[THREADS];
+	before = allocations;
+	for (i = 0; i < THREADS; i++) {
+		threads[i] = green::thread<long>([&, i] {
+			for (int r = 0; r < ROUNDS; r++) {
+				std::lock_guard<green::mutex> g(m);
+				counter++;
+				green::this_thread::yield();
+			}
+			return (long)i * i;
+		});
+	}
+	for (i = 0; i < THREADS; i++)
+		sum += threads[i].join();
+	printf("counter %ld (expected %d), sum %ld (expected 140), %ld allocations\n",
+	       counter, THREADS * ROUNDS, sum, allocations - before);
+
+	/* void result and a raw lock_t */
+	green::thread t([&] {
+		green::lock_guard g(raw);
+		counter = 0;
+	});
+	t.join();
+
+	/* an exception reaches join() */
+	green::thread bad([]() -> int { throw std::runtime_error("from a green thread"); });
+	try {
+		bad.join();
+	} catch (const std::exception &e) {
+		printf("join rethrew: %s\n", e.what());
+	}
+
+	/* too big for the stack: moved to the heap */
+	struct { char pad[1024]; } big = {};
+	before = allocations;
+	green::thread heavy([big] { return (int)sizeof(big); });
+	printf("big closure: %d bytes, %ld allocations\n", heavy.join(), allocations - before);
+
+	/* a closure that throws while it is copied into the frame */
+	struct bomb {
+		bomb() = default;
+		bomb(const bomb &) { throw std::runtime_error("copying the closure"); }
+		void operator()() const {}
+	} b;
+	try {
+		green::thread never(b);
+	} catch (const std::exception &e) {
+		printf("constructor threw: %s\n", e.what());
+	}
+
+	/* a detached thread destroys its closure, and nothing is left to join */
+	static int alive = 0;
+	struct tracked {
+		tracked() { alive++; }
+		tracked(const tracked &) { alive++; }
+		~tracked() { alive--; }
+	};
+	{
+		tracked tr;
+		green::thread d([tr] {});
+		d.detach();
+		try {
+			d.join();
+		} catch (const std::system_error &e) {
+			printf("join after detach: %s\n", e.code().message().c_str());
+		}
+	}
+	green::this_thread::yield();
+	printf("closures left after detach: %d\n", alive);
+
+	thread_exit(0);
+	return 0;
+}
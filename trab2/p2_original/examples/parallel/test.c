@@ -0,0 +1,74 @@
+/*
+  Sums an array with parallel_for and runs a few nested task groups, and
+  checks both results against a plain loop.
+*/
+
+#include <stdio.h>
+
+#include <task.h>
+#include <threadu.h>
+#include <util.h>
+
+#define N	100000
+#define GRAIN	1000
+
+static long values[N];
+static long partial[N / GRAIN + 1];
+
+void sum_range(long begin, long end, void *arg)
+{
+	long i, sum = 0;
+
+	for (i = begin; i < end; i++)
+		sum += values[i];
+	/* ranges can share a slot; tasks only switch when they yield */
+	partial[begin / GRAIN] += sum;
+}
+
+static int leaves = 0;
+
+void leaf(void *p)
+{
+	leaves++;
+}
+
+void inner(void *p)
+{
+	task_group_t g;
+	int i;
+
+	/* nested group, waited on from inside a task */
+	task_group_init(&g);
+	for (i = 0; i < 10; i++)
+		task_group_spawn(&g, leaf, NULL);
+	task_group_wait(&g);
+}
+
+int main()
+{
+	long i, expected = 0, sum = 0;
+	task_group_t g;
+	uint64_t t0;
+
+	thread_init();
+	for (i = 0; i < N; i++) {
+		values[i] = i % 97;
+		expected += values[i];
+	}
+
+	t0 = get_timer();
+	parallel_for(0, N, GRAIN, sum_range, NULL);
+	for (i = 0; i <= N / GRAIN; i++)
+		sum += partial[i];
+	printf("parallel_for: sum %ld (expected %ld), %lu cycles\n", sum,
+	       expected, get_timer() - t0);
+
+	task_group_init(&g);
+	for (i = 0; i < 10; i++)
+		task_group_spawn(&g, inner, NULL);
+	task_group_wait(&g);
+	printf("task_group: %d leaves (expected 100)\n", leaves);
+
+	task_pool_shutdown();
+	return (sum == expected && leaves == 100) ? 0 : 1;
+}
@@ -24,10 +24,11 @@ void *simple_sleep(void *p);
 void *plane(void *p)
 {
 	int locx = 80, locy = 1;
-	int sleep_time = *(int *)p;
+	int period = *(int *)p;
 	
 	clear();
-	sleep_time *= 1000;
+	/* one frame per period, ahead of the other threads when it is due */
+	thread_set_period(period * 1000);
 	while (1) {
 		print_counter();
 		/* erase plane */
@@ -39,8 +40,7 @@ void *plane(void *p)
 		/* draw plane */
 		draw(locx, locy, TRUE);
 		print_counter();
-		usleep(sleep_time);
-		thread_yield();
+		thread_wait_period();
 	}
 }
 
@@ -50,7 +50,7 @@ static void print_counter(void)
 	static int counter = 0;
 
 	print_str(23, 0, "Thread 1 (Plane)     : ");
-	printf("%d\n", counter++);
+	printf("%d (missed %lu)\n", counter++, thread_deadline_misses(NULL));
 	fflush(stdout);
 }
 
@@ -82,7 +82,7 @@ int main(int argc, char *argv[])
 	
 	if (argc != 4) {
 		fprintf(stderr, "\nUsage: plane <plane_sleep_time> <sum_sleep_time> <simple_sleep_time>\n"
-			"\tplane_sleep_time: air plane thread sleep time in milliseconds\n"
+			"\tplane_sleep_time: air plane frame period in milliseconds\n"
 			"\tsum_sleep_time: sum thread sleep time in milliseconds\n"
 			"\tSimple_sleep_time: simple thread sleep time in milliseconds\n\n");
 		exit(1);
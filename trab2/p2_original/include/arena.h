@@ -0,0 +1,63 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define CACHE_LINE_SIZE		64
+#define ARENA_CHUNK_SIZE	(256 * 1024)
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;   // Next chunk in the arena (or in the cache)
+    char *end;                  // One past the last usable byte
+} arena_chunk_t;
+
+/* Bump allocator. Allocating is a pointer bump inside the current chunk and
+ * arena_release() gives every chunk back to /cache/ at once, in O(1).
+ */
+typedef struct {
+    arena_chunk_t *head;        // Chunk we are currently bumping into
+    arena_chunk_t *tail;        // First chunk ever taken, used for the splice
+    char *cur;                  // Next free byte in head
+    char *end;                  // End of head
+    arena_chunk_t **cache;      // Where chunks come from and go back to
+} arena_t;
+
+/* Fixed-size object cache. Freed objects are kept on an intrusive free list
+ * and handed out again by slab_alloc(), so create/exit churn stays off malloc.
+ */
+typedef struct {
+    size_t object_size;
+    size_t align;
+    void *free_list;
+    arena_t arena;
+} slab_t;
+
+/* Allocation state owned by one worker (the OS thread running green
+ * threads). Nothing in here is shared, so none of it needs locking.
+ */
+typedef struct {
+    arena_chunk_t *chunk_cache; // Released chunks waiting to be reused
+    slab_t tcb_slab;            // tcb_t
+    slab_t stack_slab;          // STACK_SIZE thread stacks
+} worker_heap_t;
+
+/* Initialize an empty arena that draws its chunks from /cache/ */
+void arena_init(arena_t *arena, arena_chunk_t **cache);
+
+/* Returns /size/ bytes aligned to /align/ (a power of two), or NULL if a new
+ * chunk could not be allocated.
+ */
+void *arena_alloc(arena_t *arena, size_t size, size_t align);
+
+/* Gives every chunk of the arena back to its cache. Memory handed out by the
+ * arena must not be used after this call.
+ */
+void arena_release(arena_t *arena);
+
+/* Initialize a slab of /size/-byte objects aligned to /align/ */
+void slab_init(slab_t *slab, size_t size, size_t align, arena_chunk_t **cache);
+
+void *slab_alloc(slab_t *slab);
+void slab_free(slab_t *slab, void *object);
+
+#endif                          /* ARENA_H */
@@ -1,17 +1,35 @@
 #ifndef LOCK_H
 #define LOCK_H
 
+#include <queue.h>
 
 typedef struct {
 	enum {
 	      UNLOCKED,
 	      LOCKED,
 	} status;
-	// TODO: define a queue for the lock. 
+	node_t *wait_queue;	// Threads blocked in lock_acquire(), first come first served
+#ifdef LOCK_DEBUG
+	/* Lock-order checking, see lockdep.h. Code using lock_t must be built
+	 * with the same LOCK_DEBUG setting as the library (see LOCK_SYMBOL). */
+	int id;                 // Node of the lock in the lock-order graph
+	void *owner;            // TCB of the holder, NULL when unlocked
+	int owner_tid;          // Thread ID of the last holder
+#endif
 } lock_t;
 
-void lock_init(lock_t *);
-void lock_acquire(lock_t *);
-void lock_release(lock_t *);
+/* The layout of lock_t is part of the names of these functions: with
+ * LOCK_DEBUG they link as lock_init_lock_debug() and so on. Code built with
+ * a different LOCK_DEBUG setting than libt.a then fails to link instead of
+ * corrupting locks at run time. */
+#ifdef LOCK_DEBUG
+#define LOCK_SYMBOL(name)	__asm__(#name "_lock_debug")
+#else
+#define LOCK_SYMBOL(name)
+#endif
+
+void lock_init(lock_t *) LOCK_SYMBOL(lock_init);
+void lock_acquire(lock_t *) LOCK_SYMBOL(lock_acquire);
+void lock_release(lock_t *) LOCK_SYMBOL(lock_release);
 
 #endif                          /* LOCK_H */
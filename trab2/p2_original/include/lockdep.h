@@ -0,0 +1,47 @@
+#ifndef LOCKDEP_H
+#define LOCKDEP_H
+
+#include <lock.h>
+
+/* Lock dependency checker, enabled by building with -DLOCK_DEBUG (make
+ * LOCK_DEBUG=1). It records the order in which each thread acquires locks
+ * and reports:
+ *  - order inversions (A taken while holding B after B was taken while
+ *    holding A, or any longer cycle), with the threads that created each
+ *    edge of the cycle;
+ *  - real deadlocks, when the threads waiting in lock_acquire() form a cycle
+ *    through the lock owners, or wait for a lock held by an exited thread;
+ *  - a scheduler with no READY thread left while BLOCKED threads wait for
+ *    each other in a cycle, through locks and thread_join().
+ * Deadlocks abort the program; inversions are only reported.
+ * Without LOCK_DEBUG every hook below expands to nothing.
+ */
+
+#define LOCKDEP_MAX_LOCKS	64
+#define LOCKDEP_MAX_HELD	8
+
+#ifdef LOCK_DEBUG
+
+void lockdep_init(lock_t *l);
+void lockdep_acquire(lock_t *l);        // Before waiting for /l/
+void lockdep_wait(lock_t *l);           // Every time /l/ is found locked
+void lockdep_handoff(lock_t *l, void *tcb); // lock_release() passes /l/ to a waiter
+void lockdep_acquired(lock_t *l);       // Once /l/ is held
+void lockdep_release(lock_t *l);
+void lockdep_thread_exit(void);         // The running thread is exiting
+void lockdep_no_ready_thread(void);     // The scheduler ran out of threads
+
+#else
+
+#define lockdep_init(l)			((void)0)
+#define lockdep_acquire(l)		((void)0)
+#define lockdep_wait(l)			((void)0)
+#define lockdep_handoff(l, tcb)		((void)0)
+#define lockdep_acquired(l)		((void)0)
+#define lockdep_release(l)		((void)0)
+#define lockdep_thread_exit()		((void)0)
+#define lockdep_no_ready_thread()	((void)0)
+
+#endif                          /* LOCK_DEBUG */
+
+#endif                          /* LOCKDEP_H */
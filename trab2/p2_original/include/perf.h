@@ -0,0 +1,41 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdint.h>
+
+/* Hardware counters per worker, charged to green threads at every context
+ * switch. Off until thread_perf_enable() or THREADU_PERF=1; when it is off
+ * a switch only tests perf_enabled. Counters are user-mode only, and each
+ * one the kernel refuses is left out, so the mode still works with
+ * whatever subset a container allows.
+ */
+
+#define PERF_COUNTERS		4
+
+enum {
+    PERF_INSTRUCTIONS,
+    PERF_CYCLES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES
+};
+
+/* Set on a worker whose counters are open */
+extern __thread int perf_enabled;
+
+/* Opens the counters of the calling worker. Returns 0, or -errno if none
+ * could be opened.
+ */
+int perf_open(void);
+
+/* Whether /counter/ was opened */
+int perf_available(int counter);
+
+/* Adds what each counter counted since the last call to /counts/ */
+void perf_account(uint64_t counts[PERF_COUNTERS]);
+
+/* Same, without moving the starting point: what the running thread has
+ * counted since it was switched in
+ */
+void perf_pending(uint64_t counts[PERF_COUNTERS]);
+
+#endif                          /* PERF_H */
@@ -8,6 +8,11 @@ typedef struct node {
     struct node *next;    // Pointer to the next node in the queue
 } node_t;
 
+/* A queue is a pointer to its last node, and the last node points back at
+ * the first one. Both ends are reachable in O(1), so enqueue() does not walk
+ * the list; callers should only touch the nodes through these functions.
+ */
+
 /* Initialize a queue */
 void queue_init(node_t **queue);
 
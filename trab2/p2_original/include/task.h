@@ -0,0 +1,46 @@
+#ifndef TASK_H
+#define TASK_H
+
+/* Task groups and parallel_for on top of the thread library. Tasks run on a
+ * fixed pool of worker threads, created once, instead of getting a thread
+ * (and a stack) each; a thread waiting on a group runs queued tasks itself
+ * while it waits, so groups can be nested inside tasks. Workers with nothing
+ * to run, and waiters with nothing left to help with, block until a spawn or
+ * the end of the group wakes them.
+ */
+
+#include <threadu.h>
+
+#define TASK_DEFAULT_WORKERS	4
+#define TASK_MAX_WORKERS	64
+
+typedef struct task_group {
+    int pending;                // Spawned tasks that have not finished yet
+    int waiting;                // waiter is blocked until pending reaches 0
+    thread_t waiter;
+} task_group_t;
+
+/* Starts /nworkers/ worker threads. Optional: the first spawn starts
+ * TASK_DEFAULT_WORKERS of them. Returns -EINVAL if the pool is running.
+ */
+int task_pool_init(int nworkers);
+
+/* Lets the workers finish the queued tasks and joins them */
+void task_pool_shutdown();
+
+void task_group_init(task_group_t *group);
+
+/* Queues fn(arg) as part of /group/. Returns 0 or -ENOMEM. */
+int task_group_spawn(task_group_t *group, void (*fn)(void *), void *arg);
+
+/* Returns once every task spawned in /group/ has finished */
+void task_group_wait(task_group_t *group);
+
+/* Calls fn(b, e, arg) over subranges [b, e) covering [begin, end), none
+ * longer than /grain/. Ranges are split in halves recursively by the tasks
+ * themselves. Returns once the whole range is done, 0 or -ENOMEM.
+ */
+int parallel_for(long begin, long end, long grain,
+                 void (*fn)(long begin, long end, void *arg), void *arg);
+
+#endif                          /* TASK_H */
@@ -1,12 +1,42 @@
 #ifndef THREAD_H
 #define THREAD_H
 
+#define NUMBER_OF_REGISTERS	15
+#ifndef STACK_SIZE
+#define STACK_SIZE		16384
+#endif
+
+/* THREAD_STATIC builds libt-static.a, which never touches the heap: every
+ * TCB, stack, queue node and thread_alloc() area is set aside in arrays of
+ * THREAD_MAX_THREADS slots (the main thread takes one), and a thread's ID
+ * is its slot. Each thread may thread_alloc() up to THREAD_ARENA_SIZE
+ * bytes. The Makefile passes all three.
+ */
+#ifdef THREAD_STATIC
+#ifndef THREAD_MAX_THREADS
+#define THREAD_MAX_THREADS	64
+#endif
+#ifndef THREAD_ARENA_SIZE
+#define THREAD_ARENA_SIZE	4096
+#endif
+#endif
+
+/* Layout shared with entry.S. SAVE_CONTEXT pushes the registers and the
+ * flags on the thread's own stack and stores the resulting stack pointer at
+ * TCB_STACK_POINTER; thread.c checks these against offsetof() and sizeof().
+ */
+#define CONTEXT_SIZE		((NUMBER_OF_REGISTERS + 1) * 8)
+#define TCB_STACK_POINTER	0
+
+#ifndef __ASSEMBLER__
+
+#include <stdatomic.h>
 #include <stdint.h>
+#include <arena.h>
+#include <lockdep.h>
+#include <perf.h>
 #include <threadu.h>
 
-#define NUMBER_OF_REGISTERS	15
-#define STACK_SIZE		2048
-
 void scheduler_entry();
 void scheduler();
 void exit_handler();
@@ -18,16 +48,53 @@ typedef enum {
 	      EXITED
 } status_t;
 
-typedef struct tcb {
-    int tid;                           // Thread ID
-    uint64_t *stack_pointer;           // Pointer to the saved stack
+/* Fields only needed when a thread is created, exits or is joined */
+typedef struct tcb_cold {
+    // A thread is in at most one of the ready, deadline and sleep queues at a
+    // time, so making it ready never needs to allocate
+    node_t run_node;
     void *(*start_routine)(void *);    // Thread's start routine
     void *arg;                         // Argument to the start routine
     int exit_status;                   // Exit status
+    void *stack;                       // Base of the stack allocation
+    arena_t arena;                     // Memory from thread_alloc(), freed at exit
+    uint64_t period;                   // get_timer() ticks, 0 without a period
+    unsigned long deadline_misses;     // Jobs finished past their deadline
+    struct tcb *joiner;                // Blocked in thread_join() on this thread
+    // thread_unblock(), which may run on another OS thread
+    atomic_int wake_permit;            // Consumed by the next thread_block()
+    atomic_int wake_queued;            // On the wakeup list
+    struct tcb *wake_next;             // Next on the wakeup list
+    lock_t *waiting_for;               // Lock the thread is waiting for
+    node_t lock_node;                  // Its place in the wait queue of that lock
+    uint64_t perf[PERF_COUNTERS];      // Hardware counters while it ran, see perf.h
+    struct tcb *prev_live, *next_live; // Registry of live threads, for thread_dump()
+#ifdef LOCK_DEBUG
+    lock_t *held_locks[LOCKDEP_MAX_HELD]; // Locks held, in acquisition order
+    int num_held;
+#endif
+} tcb_cold_t;
+
+/* Everything a context switch touches lives in the first cache line */
+typedef struct tcb {
+    uint64_t *stack_pointer;           // Saved stack pointer, see entry.S
+    int tid;                           // Thread ID
     status_t thread_status;            // Current status of the thread
-	uint64_t cpu_time;                 // CPU time of the thread
-    struct tcb *next;                  // Pointer to the next TCB in the ready queue
+    uint64_t cpu_time;                 // CPU time of the thread
+    uint64_t last_run;                 // get_timer() when last dispatched
+    uint64_t deadline;                 // Absolute, in get_timer() ticks; 0 for FIFO
+    uint64_t release;                  // Not dispatched before this get_timer()
+    uint64_t *stack_low;               // Deepest stack_pointer saved at a switch
+    _Alignas(CACHE_LINE_SIZE) tcb_cold_t cold;
 } tcb_t;
 
+/* Every thread that has not been joined, newest first. Only the worker
+ * changes the list, and each change is a single store once the TCB is
+ * ready to be seen, so a signal handler on the worker can walk it.
+ */
+extern tcb_t *live_threads;
+extern tcb_t *current_running;
+
+#endif /* __ASSEMBLER__ */
 
 #endif /* THREAD_H */
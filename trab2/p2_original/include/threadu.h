@@ -1,6 +1,9 @@
 #ifndef THREADU_H
 #define THREADU_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef enum {
     FALSE, TRUE
 } bool_t;
@@ -14,6 +17,103 @@ int thread_yield();
 int thread_join(thread_t *thread, int *retval); 
 int thread_init();
 
+/* Like thread_create(), but sets aside /size/ bytes at the top of the new
+ * thread's stack and passes their address to start_routine. *arg gets the
+ * same address, for the caller to fill in before the thread first runs,
+ * which is at the caller's next yield. The bytes stay valid until the
+ * thread is joined. Returns -EINVAL if size is 0 or more than a quarter of
+ * the stack.
+ */
+int thread_create_inline(thread_t *thread, void *(*start_routine)(void *), size_t size,
+                         void **arg);
+
+/* Waits for /thread/ to exit without releasing it, so that its stack can
+ * still be read; thread_join() must follow. Returns 0.
+ */
+int thread_wait(thread_t *thread);
+
 void thread_exit(int status);
 
+/* Handle of the running thread */
+thread_t thread_self(void);
+
+/* Blocks the running thread until thread_unblock() is called on it. A call
+ * that came first is not lost: the next thread_block() returns at once.
+ * Wakeups may be spurious, so wait for a condition in a loop.
+ */
+void thread_block(void);
+
+/* Makes a blocked thread ready. Safe from any OS thread and from signal
+ * handlers; a worker parked for lack of work wakes up to run it.
+ */
+void thread_unblock(thread_t *thread);
+
+/* What a thread has used so far. The hardware counters are those of its
+ * worker while it ran, from the time thread_perf_enable() succeeded; a
+ * counter that could not be opened reads -1.
+ */
+typedef struct {
+    uint64_t cpu_time;                  // get_timer() cycles
+    unsigned long deadline_misses;
+    int64_t instructions;
+    int64_t cycles;
+    int64_t llc_misses;
+    int64_t branch_misses;
+} thread_stats_t;
+
+/* Fills /stats/ for /thread/, or for the running thread if it is NULL. A
+ * thread that has exited can be asked until it is joined.
+ */
+void thread_stats(thread_t *thread, thread_stats_t *stats);
+
+/* Opens perf counters on the calling worker and charges them to each
+ * green thread at every switch, with rdpmc where the kernel allows it and
+ * read() otherwise. thread_init() tries it when THREADU_PERF is 1. Returns
+ * 0, or -errno when no counter is available (as in most containers), in
+ * which case the stats read -1 and switches cost nothing extra.
+ */
+int thread_perf_enable(void);
+
+/* Writes every thread that has not been joined to fd, one line each or,
+ * with json set, as one JSON document: tid, status, CPU time, cycles since
+ * it last ran, deepest stack use seen at a switch (a lower bound on the
+ * true peak: calls between switches are not seen) and the lock it waits
+ * for. Safe from a signal handler on the worker. Returns 0 or -errno.
+ */
+int thread_dump(int fd, int json);
+
+/* Runs thread_dump(STDERR_FILENO, json) whenever /signo/ arrives.
+ * thread_init() does it for SIGUSR1, unless the program handles SIGUSR1
+ * itself, with JSON if THREADU_DUMP is "json". Other OS threads in the
+ * process should block the signal so that it reaches the worker.
+ */
+int thread_dump_on_signal(int signo, int json);
+
+/* Allocates memory owned by the running thread. It never needs to be freed:
+ * everything the thread allocated is released at once by thread_exit().
+ */
+void *thread_alloc(size_t size);
+
+/* Earliest-deadline-first scheduling. A thread with a deadline is always
+ * dispatched before the FIFO threads, and among those with a deadline the
+ * one with the nearest goes first. Scheduling is still cooperative: a
+ * deadline only takes effect at the next yield of whichever thread runs.
+ *
+ * thread_set_period() gives the running thread a job every /period_us/
+ * microseconds, due by the start of the next one; 0 returns it to FIFO.
+ * thread_wait_period() ends the current job and sleeps until the next is
+ * released. A job that ends late counts as a miss, and so does every
+ * release it overran, which is skipped to keep the thread in phase.
+ *
+ * thread_set_deadline() gives the running thread a single job due
+ * /deadline_us/ from now, with no period; 0 returns it to FIFO.
+ *
+ * thread_deadline_misses() returns the misses of /thread/, or of the
+ * running thread if it is NULL.
+ */
+int thread_set_period(unsigned long period_us);
+int thread_set_deadline(unsigned long deadline_us);
+void thread_wait_period(void);
+unsigned long thread_deadline_misses(thread_t *thread);
+
 #endif /* THREADU_H */
@@ -0,0 +1,306 @@
+#ifndef THREADU_HPP
+#define THREADU_HPP
+
+/* C++17 interface to threadu, header only.
+ *
+ *   green::thread t([&] { return sum(v); });
+ *   int s = t.join();
+ *
+ * green::thread runs any callable. The callable and its result live at the
+ * top of the new thread's stack (see thread_create_inline()), so spawning a
+ * capturing lambda allocates nothing but the stack itself. Callables larger
+ * than green::inline_capacity are moved to the heap instead. An exception
+ * that escapes the callable is rethrown by join().
+ *
+ * green::lock_guard holds a lock_t for a scope; green::mutex owns one and
+ * works with std::lock_guard and std::unique_lock.
+ */
+
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <new>
+#include <optional>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+extern "C" {
+#include <threadu.h>
+#include <lock.h>
+}
+
+namespace green {
+
+/* Largest callable kept on the thread's stack */
+inline constexpr std::size_t inline_capacity = 256;
+
+namespace detail {
+
+// Ahead of the frame at the top of the thread's stack, so that the thread
+// can tell whether the frame was ever built. Only the worker that created
+// the thread runs it, so no atomics are needed.
+struct alignas(16) header {
+    enum { unconstructed, running, detached, finished } state = unconstructed;
+};
+
+// What the owner of a thread reads at join(), whatever the callable
+template <typename R>
+struct frame_base {
+    std::optional<R> result;
+    std::exception_ptr error;
+    void (*destroy)(frame_base *);
+
+    R take() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return std::move(*result);
+    }
+};
+
+template <>
+struct frame_base<void> {
+    std::exception_ptr error;
+    void (*destroy)(frame_base *);
+
+    void take() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+template <typename F, typename R>
+struct frame : frame_base<R> {
+    static constexpr bool on_stack = sizeof(F) <= inline_capacity;
+    std::conditional_t<on_stack, F, std::unique_ptr<F>> fn;
+
+    template <typename G>
+    explicit frame(G &&g) : fn(make(std::forward<G>(g))) {
+        this->destroy = [](frame_base<R> *self) { static_cast<frame *>(self)->~frame(); };
+    }
+
+    template <typename G>
+    static decltype(auto) make(G &&g) {
+        if constexpr (on_stack) {
+            return std::forward<G>(g);
+        } else {
+            return std::make_unique<F>(std::forward<G>(g));
+        }
+    }
+
+    F &callable() {
+        if constexpr (on_stack) {
+            return fn;
+        } else {
+            return *fn;
+        }
+    }
+
+    // Start routine of the thread: /arg/ is the header, on its own stack
+    static void *run(void *arg) {
+        auto *slot = static_cast<header *>(arg);
+
+        if (slot->state == header::unconstructed) {
+            // Building the frame threw; the constructor is waiting to join
+            thread_exit(0);
+        }
+        auto *self = std::launder(reinterpret_cast<frame *>(slot + 1));
+        try {
+            if constexpr (std::is_void_v<R>) {
+                std::invoke(std::move(self->callable()));
+            } else {
+                self->result.emplace(std::invoke(std::move(self->callable())));
+            }
+        } catch (...) {
+            self->error = std::current_exception();
+        }
+        // Nobody will join a detached thread, so release the callable here
+        if (std::exchange(slot->state, header::finished) == header::detached) {
+            self->~frame();
+        }
+        thread_exit(0);
+        return nullptr;
+    }
+};
+
+}  // namespace detail
+
+/* A green thread running a callable that returns R. Move-only; like
+ * std::thread, it must be joined or detached before it is destroyed.
+ */
+template <typename R>
+class thread {
+public:
+    thread() noexcept = default;
+
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, thread>>>
+    explicit thread(F &&f) {
+        using frame = detail::frame<std::decay_t<F>, R>;
+        // thread_create_inline() aligns the slot to 16 bytes
+        static_assert(alignof(frame) <= alignof(detail::header));
+        void *slot;
+
+        int ret = thread_create_inline(&handle_, &frame::run,
+                                       sizeof(detail::header) + sizeof(frame), &slot);
+        if (ret < 0) {
+            throw std::bad_alloc();
+        }
+        // The thread does not run before we yield, so its frame is ready by
+        // then. If building it throws, the thread finds the header still
+        // unconstructed and exits at once.
+        auto *h = new (slot) detail::header;
+        try {
+            frame_ = new (h + 1) frame(std::forward<F>(f));
+        } catch (...) {
+            thread_join(&handle_, nullptr);
+            throw;
+        }
+        h->state = detail::header::running;
+        slot_ = h;
+    }
+
+    thread(thread &&other) noexcept
+        : handle_(std::exchange(other.handle_, thread_t{nullptr})),
+          slot_(std::exchange(other.slot_, nullptr)),
+          frame_(std::exchange(other.frame_, nullptr)) {
+    }
+
+    thread &operator=(thread &&other) noexcept {
+        if (joinable()) {
+            std::terminate();
+        }
+        handle_ = std::exchange(other.handle_, thread_t{nullptr});
+        slot_ = std::exchange(other.slot_, nullptr);
+        frame_ = std::exchange(other.frame_, nullptr);
+        return *this;
+    }
+
+    thread(const thread &) = delete;
+    thread &operator=(const thread &) = delete;
+
+    ~thread() {
+        if (joinable()) {
+            std::terminate();
+        }
+    }
+
+    bool joinable() const noexcept {
+        return frame_ != nullptr;
+    }
+
+    /* Waits for the thread and returns what the callable returned. Throws
+     * std::system_error if the thread is not joinable.
+     */
+    R join() {
+        if (!joinable()) {
+            throw std::system_error(std::make_error_code(std::errc::invalid_argument),
+                                    "green::thread::join");
+        }
+        slot_ = nullptr;
+        auto *f = std::exchange(frame_, nullptr);
+
+        thread_wait(&handle_);
+        struct release {
+            detail::frame_base<R> *f;
+            thread_t *handle;
+            ~release() {
+                f->destroy(f);
+                thread_join(handle, nullptr);
+            }
+        } guard{f, &handle_};
+        return f->take();
+    }
+
+    /* Lets the thread run on its own. The callable and its result are
+     * destroyed when it finishes, but its stack is only reclaimed if it
+     * already has; otherwise it stays, as with a thread_create() that nobody
+     * joins. Throws std::system_error if the thread is not joinable.
+     */
+    void detach() {
+        if (!joinable()) {
+            throw std::system_error(std::make_error_code(std::errc::invalid_argument),
+                                    "green::thread::detach");
+        }
+        auto *slot = std::exchange(slot_, nullptr);
+        auto *f = std::exchange(frame_, nullptr);
+        if (std::exchange(slot->state, detail::header::detached) == detail::header::finished) {
+            f->destroy(f);
+            thread_join(&handle_, nullptr);
+        }
+    }
+
+    thread_t native_handle() const noexcept {
+        return handle_;
+    }
+
+private:
+    thread_t handle_{nullptr};
+    detail::header *slot_ = nullptr;
+    detail::frame_base<R> *frame_ = nullptr;
+};
+
+template <typename F>
+thread(F &&) -> thread<std::invoke_result_t<std::decay_t<F>>>;
+
+/* Holds a lock_t from construction to the end of the scope */
+class lock_guard {
+public:
+    explicit lock_guard(lock_t &l) : lock_(l) {
+        lock_acquire(&lock_);
+    }
+
+    ~lock_guard() {
+        lock_release(&lock_);
+    }
+
+    lock_guard(const lock_guard &) = delete;
+    lock_guard &operator=(const lock_guard &) = delete;
+
+private:
+    lock_t &lock_;
+};
+
+/* A lock_t with the BasicLockable interface */
+class mutex {
+public:
+    mutex() noexcept {
+        lock_init(&lock_);
+    }
+
+    mutex(const mutex &) = delete;
+    mutex &operator=(const mutex &) = delete;
+
+    void lock() {
+        lock_acquire(&lock_);
+    }
+
+    void unlock() {
+        lock_release(&lock_);
+    }
+
+    lock_t *native_handle() noexcept {
+        return &lock_;
+    }
+
+private:
+    lock_t lock_;
+};
+
+namespace this_thread {
+
+inline void yield() {
+    thread_yield();
+}
+
+inline thread_t self() {
+    return thread_self();
+}
+
+}  // namespace this_thread
+
+}  // namespace green
+
+#endif /* THREADU_HPP */
@@ -0,0 +1,57 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <stddef.h>
+
+/* CPU and NUMA placement of workers (the OS threads running green threads).
+ *
+ * The topology comes from /sys/devices/system/node, or from THREADU_TOPOLOGY
+ * when it is set: one CPU list per node, separated by semicolons, such as
+ * "0-3;4-7". Nodes of an overridden topology may not exist, so their memory
+ * is never bound; it lands on whatever node first touches it.
+ *
+ * thread_init() pins the worker that calls it to THREADU_CPUS, a CPU list,
+ * when that is set.
+ */
+
+#define TOPOLOGY_MAX_CPUS	1024
+#define TOPOLOGY_MAX_NODES	64
+
+typedef struct {
+    int num_nodes;
+    int num_cpus;                       // Highest CPU + 1
+    short cpu_node[TOPOLOGY_MAX_CPUS];  // -1 for a CPU in no node
+    int synthetic;                      // From THREADU_TOPOLOGY
+} topology_t;
+
+/* Fills /t/ from THREADU_TOPOLOGY, or from sysfs. Without either, every CPU
+ * is in node 0. Returns 0, or -EINVAL for a malformed override.
+ */
+int topology_load(topology_t *t);
+
+/* The topology of the process, loaded on first use. A malformed override
+ * is reported and ignored.
+ */
+const topology_t *topology(void);
+
+/* Pins the calling worker to the CPUs of /cpus/, a CPU list such as
+ * "0-3,8", and makes the node of the first one its home node. Returns 0 or
+ * a negative errno.
+ */
+int worker_pin(const char *cpus);
+
+/* Pins the calling worker to every CPU of /node/ */
+int worker_pin_node(int node);
+
+/* Home node of the calling worker, -1 if it is not pinned */
+int worker_node(void);
+
+/* Asks for the pages within [addr, addr + len) to come from the home node
+ * of the calling worker. Nothing happens for a worker that is not pinned or
+ * a synthetic topology. The policy stays with the pages until they are
+ * unmapped, so /addr/ should be a mapping of its own rather than heap
+ * memory that other allocations share pages with.
+ */
+void worker_bind_memory(void *addr, size_t len);
+
+#endif                          /* TOPOLOGY_H */
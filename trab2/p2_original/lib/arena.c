@@ -0,0 +1,119 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <arena.h>
+#include <topology.h>
+
+#define ALIGN_UP(x, a)	(((x) + ((a) - 1)) & ~((uintptr_t)(a) - 1))
+
+void arena_init(arena_t *arena, arena_chunk_t **cache) {
+    arena->head = NULL;
+    arena->tail = NULL;
+    arena->cur = NULL;
+    arena->end = NULL;
+    arena->cache = cache;
+}
+
+// Takes a chunk with room for at least /size/ bytes, from the cache if the
+// first cached chunk is big enough, from a mapping of its own otherwise, on
+// the worker's home node
+static arena_chunk_t *arena_new_chunk(arena_t *arena, size_t size) {
+    size_t header = ALIGN_UP(sizeof(arena_chunk_t), CACHE_LINE_SIZE);
+    arena_chunk_t *chunk = *arena->cache;
+
+    if (chunk != NULL && (size_t)(chunk->end - (char *)chunk) - header >= size) {
+        *arena->cache = chunk->next;
+    } else {
+#ifdef THREAD_STATIC
+        return NULL;  // Only the chunks put in the cache up front
+#else
+        size_t chunk_size = ARENA_CHUNK_SIZE;
+
+        if (header + size > chunk_size) {
+            chunk_size = ALIGN_UP(header + size, sysconf(_SC_PAGESIZE));
+        }
+        // Not from malloc: the binding below applies to whole pages, which
+        // must not be shared with memory of other threads
+        chunk = (arena_chunk_t *)mmap(NULL, chunk_size, PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED) {
+            return NULL;
+        }
+        // Before the first touch, so a pinned worker gets local pages
+        worker_bind_memory(chunk, chunk_size);
+        chunk->end = (char *)chunk + chunk_size;
+#endif
+    }
+
+    chunk->next = arena->head;
+    if (arena->tail == NULL) {
+        arena->tail = chunk;
+    }
+    arena->head = chunk;
+    arena->cur = (char *)chunk + header;
+    arena->end = chunk->end;
+
+    return chunk;
+}
+
+void *arena_alloc(arena_t *arena, size_t size, size_t align) {
+    char *p = (char *)ALIGN_UP((uintptr_t)arena->cur, align);
+
+    if (arena->cur == NULL || p + size > arena->end) {
+        // Chunks start cache-line aligned, so asking for size + align is
+        // always enough
+        if (arena_new_chunk(arena, size + align) == NULL) {
+            return NULL;
+        }
+        p = (char *)ALIGN_UP((uintptr_t)arena->cur, align);
+    }
+    arena->cur = p + size;
+
+    return p;
+}
+
+void arena_release(arena_t *arena) {
+    if (arena->head == NULL) {
+        return;
+    }
+
+    // The chunks already form a list from head to tail: splice it in front
+    // of the cache instead of walking it
+    arena->tail->next = *arena->cache;
+    *arena->cache = arena->head;
+
+    arena->head = NULL;
+    arena->tail = NULL;
+    arena->cur = NULL;
+    arena->end = NULL;
+}
+
+void slab_init(slab_t *slab, size_t size, size_t align, arena_chunk_t **cache) {
+    if (size < sizeof(void *)) {
+        size = sizeof(void *);
+    }
+    slab->object_size = ALIGN_UP(size, align);
+    slab->align = align;
+    slab->free_list = NULL;
+    arena_init(&slab->arena, cache);
+}
+
+void *slab_alloc(slab_t *slab) {
+    void *object = slab->free_list;
+
+    if (object != NULL) {
+        slab->free_list = *(void **)object;
+        return object;
+    }
+
+    return arena_alloc(&slab->arena, slab->object_size, slab->align);
+}
+
+void slab_free(slab_t *slab, void *object) {
+    if (object == NULL) {
+        return;
+    }
+    *(void **)object = slab->free_list;
+    slab->free_list = object;
+}
@@ -0,0 +1,184 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <thread.h>
+#include <util.h>
+
+// thread_dump() may run in a signal handler: no stdio streams and no
+// malloc, only snprintf() into a buffer on the stack and write()
+typedef struct {
+    int fd;
+    int error;
+    size_t len;
+    char buf[1024];
+} dump_out_t;
+
+static int dump_json;
+
+static void flush(dump_out_t *out) {
+    size_t done = 0;
+
+    while (done < out->len && out->error == 0) {
+        ssize_t n = write(out->fd, out->buf + done, out->len - done);
+        if (n < 0 && errno != EINTR) {
+            out->error = errno;
+        } else if (n > 0) {
+            done += n;
+        }
+    }
+    out->len = 0;
+}
+
+static void emit(dump_out_t *out, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(out->buf + out->len, sizeof(out->buf) - out->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    if (out->len + n >= sizeof(out->buf)) {
+        // Did not fit: flush what came before and format it again
+        flush(out);
+        va_start(ap, fmt);
+        n = vsnprintf(out->buf, sizeof(out->buf), fmt, ap);
+        va_end(ap);
+        if (n >= (int)sizeof(out->buf)) {
+            n = sizeof(out->buf) - 1;
+        }
+    }
+    out->len += n;
+}
+
+// Hardware counters, when thread_perf_enable() got any; -1 for the rest
+static void dump_perf(dump_out_t *out, tcb_t *tcb, int json) {
+    thread_t handle = {tcb};
+    thread_stats_t st;
+
+    if (!perf_enabled) {
+        return;
+    }
+    thread_stats(&handle, &st);
+    emit(out, json ? ", \"instructions\": %ld, \"cycles\": %ld, \"llc_misses\": %ld, "
+                     "\"branch_misses\": %ld"
+                   : "  instr %ld cyc %ld llc %ld br %ld",
+         (long)st.instructions, (long)st.cycles, (long)st.llc_misses,
+         (long)st.branch_misses);
+}
+
+static void dump_thread(dump_out_t *out, tcb_t *tcb, uint64_t now, int json, int first) {
+    static const char *status[] = {"FIRST_TIME", "READY", "BLOCKED", "EXITED"};
+    int running = tcb == current_running;
+    uint64_t cpu = tcb->cpu_time, idle = 0;
+    long stack = -1;                   // Deepest seen at a switch, not a high-water mark
+    lock_t *lock = tcb->cold.waiting_for;
+
+    if (running) {
+        cpu += now - tcb->last_run;
+    } else if (tcb->last_run != 0) {
+        idle = now - tcb->last_run;
+    }
+    if (tcb->cold.stack != NULL) {
+        char *top = (char *)tcb->cold.stack + STACK_SIZE;
+        char *low = (char *)tcb->stack_low;
+        char here;
+
+        // stack_low is only sampled at switches, so deeper calls in
+        // between are missed. The running thread also counts where it is now.
+        if (running && &here < low && &here >= (char *)tcb->cold.stack) {
+            low = &here;
+        }
+        stack = top - low;
+    }
+
+    if (json) {
+        emit(out, "%s\n    {\"tid\": %d, \"status\": \"%s\", \"running\": %s, "
+             "\"cpu_time\": %lu, \"since_last_run\": %lu, ",
+             first ? "" : ",", tcb->tid, status[tcb->thread_status],
+             running ? "true" : "false", (unsigned long)cpu, (unsigned long)idle);
+        if (stack >= 0) {
+            emit(out, "\"stack_at_switch\": %ld, \"stack_size\": %d, ", stack, STACK_SIZE);
+        } else {
+            emit(out, "\"stack_at_switch\": null, \"stack_size\": null, ");
+        }
+        if (lock == NULL) {
+            emit(out, "\"waiting_for\": null");
+        } else {
+#ifdef LOCK_DEBUG
+            emit(out, "\"waiting_for\": {\"lock\": \"%p\", \"id\": %d, \"owner\": %d}",
+                 (void *)lock, lock->id, lock->owner_tid);
+#else
+            emit(out, "\"waiting_for\": {\"lock\": \"%p\"}", (void *)lock);
+#endif
+        }
+        dump_perf(out, tcb, json);
+        emit(out, "}");
+        return;
+    }
+
+    emit(out, "%c%5d %-10s cpu %12lu  idle %12lu  stack@switch ", running ? '*' : ' ',
+         tcb->tid, status[tcb->thread_status], (unsigned long)cpu, (unsigned long)idle);
+    if (stack >= 0) {
+        emit(out, "%5ld/%d", stack, STACK_SIZE);
+    } else {
+        emit(out, "%11s", "-");
+    }
+    if (lock != NULL) {
+#ifdef LOCK_DEBUG
+        emit(out, "  waiting for lock #%d %p held by thread %d", lock->id,
+             (void *)lock, lock->owner_tid);
+#else
+        emit(out, "  waiting for lock %p", (void *)lock);
+#endif
+    }
+    dump_perf(out, tcb, json);
+    emit(out, "\n");
+}
+
+int thread_dump(int fd, int json) {
+    dump_out_t out = {fd, 0, 0, {0}};
+    uint64_t now = get_timer();
+    tcb_t *tcb;
+    int n = 0;
+
+    if (json) {
+        emit(&out, "{\"timer\": %lu, \"threads\": [", (unsigned long)now);
+    } else {
+        emit(&out, "threads at %lu (* running, times in get_timer() cycles):\n",
+             (unsigned long)now);
+    }
+    for (tcb = live_threads; tcb != NULL; tcb = tcb->cold.next_live) {
+        dump_thread(&out, tcb, now, json, n++ == 0);
+    }
+    emit(&out, json ? "\n]}\n" : "%d threads\n", n);
+    flush(&out);
+
+    return -out.error;
+}
+
+static void dump_handler(int signo) {
+    int saved = errno;
+
+    thread_dump(STDERR_FILENO, dump_json);
+    errno = saved;
+}
+
+int thread_dump_on_signal(int signo, int json) {
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = dump_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    dump_json = json;
+    if (sigaction(signo, &sa, NULL) != 0) {
+        return -errno;
+    }
+    return 0;
+}
@@ -1,47 +1,63 @@
 #include <lock.h>
-#include <threadu.h>
+#include <lockdep.h>
+#include <queue.h>
+#include <thread.h>
 
-enum {
-      SPIN = TRUE,
-};
-
-// TODO: inicializes a lock
+// Initializes a lock
 void lock_init(lock_t * l)
 {
-	if (SPIN) {
-		l->status = UNLOCKED;
-	} else {
-	}
+	l->status = UNLOCKED;
+	queue_init(&l->wait_queue);
+	lockdep_init(l);
 }
 
-// TODO:  acquires a  lock if  it is  available or  blocks the  thread
-// otherwise
-void lock_acquire(lock_t * l)
+// Blocks the running thread until lock_release() hands it /l/
+static void block(lock_t *l)
 {
-	if (SPIN) {
-		while (LOCKED == l->status)
-			thread_yield();
-		l->status = LOCKED;
-	} else {
-	}
+	tcb_t *self = current_running;
+
+	/* shown by thread_dump() while we wait */
+	self->cold.waiting_for = l;
+	self->cold.lock_node.thread = self;
+	enqueue(&l->wait_queue, &self->cold.lock_node);
+	lockdep_wait(l);
+	/* lock_release() clears waiting_for as it passes the lock on; any
+	 * other wakeup is spurious */
+	while (self->cold.waiting_for == l)
+		thread_block();
 }
 
-// TODO:  releases a  lock  and  unlocks one  thread  from the  lock's
-// blocking list
-void lock_release(lock_t * l)
+// Passes /l/ on to the first thread waiting for it, still LOCKED. Returns
+// 0 if nobody waits.
+static int unblock(lock_t *l)
 {
-	if (SPIN) {
-		l->status = UNLOCKED;
-	} else {
-	}
+	node_t *node = dequeue(&l->wait_queue);
+	thread_t waiter;
+
+	if (node == NULL)
+		return 0;
+	waiter.tcb = node->thread;
+	lockdep_handoff(l, waiter.tcb);
+	((tcb_t *)waiter.tcb)->cold.waiting_for = NULL;
+	thread_unblock(&waiter);
+	return 1;
 }
 
-// TODO: blocks the running thread
-void block()
+// Acquires a lock if it is available or blocks the thread otherwise
+void lock_acquire(lock_t * l)
 {
+	lockdep_acquire(l);
+	if (LOCKED == l->status)
+		block(l);	/* ours once block() returns */
+	else
+		l->status = LOCKED;
+	lockdep_acquired(l);
 }
 
-// TODO: unblocks  a thread that is waiting on a lock.
-void unblock(lock_t *l)
+// Releases a lock, or hands it to the first thread blocked on it
+void lock_release(lock_t * l)
 {
+	lockdep_release(l);
+	if (!unblock(l))
+		l->status = UNLOCKED;
 }
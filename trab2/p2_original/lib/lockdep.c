@@ -0,0 +1,277 @@
+#ifdef LOCK_DEBUG
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <lockdep.h>
+#include <thread.h>
+
+static lock_t *locks[LOCKDEP_MAX_LOCKS];   // Registered locks, by id
+static int num_locks = 0;
+
+// after[a] has bit b set when b was acquired while a was held; edge_tid[a][b]
+// is the thread that first did it
+static uint64_t after[LOCKDEP_MAX_LOCKS];
+static int edge_tid[LOCKDEP_MAX_LOCKS][LOCKDEP_MAX_LOCKS];
+
+// Inversions already reported, so a loop does not print the same one forever
+static uint64_t reported[LOCKDEP_MAX_LOCKS];
+
+
+void lockdep_init(lock_t *l) {
+    int i;
+
+    l->owner = NULL;
+    l->owner_tid = -1;
+    // lock_init() may be called again on a lock that is already registered
+    for (i = 0; i < num_locks; i++) {
+        if (locks[i] == l) {
+            l->id = i;
+            return;
+        }
+    }
+    if (num_locks == LOCKDEP_MAX_LOCKS) {
+        fprintf(stderr, "lockdep: more than %d locks, not tracking %p\n",
+                LOCKDEP_MAX_LOCKS, (void *)l);
+        l->id = -1;
+        return;
+    }
+    l->id = num_locks;
+    locks[num_locks++] = l;
+}
+
+// Depth-first search for a path from /from/ to /to/ in the order graph.
+// Fills /path/ with the nodes after /from/ and returns its length, 0 if none.
+static int find_path(int from, int to, int *path, int depth, uint64_t *seen) {
+    int next;
+
+    if (depth == LOCKDEP_MAX_LOCKS) {
+        return 0;
+    }
+    for (next = 0; next < num_locks; next++) {
+        if (!(after[from] & (1ULL << next)) || (*seen & (1ULL << next))) {
+            continue;
+        }
+        path[depth] = next;
+        if (next == to) {
+            return depth + 1;
+        }
+        *seen |= 1ULL << next;
+        int len = find_path(next, to, path, depth + 1, seen);
+        if (len > 0) {
+            return len;
+        }
+    }
+    return 0;
+}
+
+void lockdep_acquire(lock_t *l) {
+    tcb_t *self = current_running;
+    int path[LOCKDEP_MAX_LOCKS];
+    int i, j, len, prev;
+    uint64_t seen;
+
+    if (l->id < 0) {
+        return;
+    }
+    if (l->owner == self) {
+        fprintf(stderr, "lockdep: thread %d acquires lock #%d it already holds\n",
+                self->tid, l->id);
+        abort();
+    }
+
+    for (i = 0; i < self->cold.num_held; i++) {
+        int held = self->cold.held_locks[i]->id;
+
+        if (held < 0 || (after[held] & (1ULL << l->id))) {
+            continue;
+        }
+
+        // Taking l after held closes a cycle if held already follows l
+        seen = 1ULL << l->id;
+        len = find_path(l->id, held, path, 0, &seen);
+        if (len > 0 && !(reported[held] & (1ULL << l->id))) {
+            reported[held] |= 1ULL << l->id;
+            fprintf(stderr, "lockdep: lock order inversion\n");
+            fprintf(stderr, "  thread %d acquires lock #%d while holding lock #%d\n",
+                    self->tid, l->id, held);
+            prev = l->id;
+            for (j = 0; j < len; j++) {
+                fprintf(stderr, "  thread %d acquired lock #%d while holding lock #%d\n",
+                        edge_tid[prev][path[j]], path[j], prev);
+                prev = path[j];
+            }
+        }
+
+        after[held] |= 1ULL << l->id;
+        edge_tid[held][l->id] = self->tid;
+    }
+}
+
+void lockdep_wait(lock_t *l) {
+    tcb_t *self = current_running;
+    tcb_t *owner;
+    lock_t *waiting;
+    int hops;
+
+    // lock_acquire() has set self->cold.waiting_for to /l/
+
+    // Follow "waits for a lock owned by" edges; coming back to ourselves is
+    // a deadlock. The chain is at most as long as the number of locks.
+    waiting = l;
+    for (hops = 0; hops <= num_locks && waiting != NULL; hops++) {
+        owner = (tcb_t *)waiting->owner;
+        if (owner == NULL) {
+            // lockdep_thread_exit() drops the owner of locks still held
+            if (waiting->status == LOCKED && waiting->owner_tid >= 0) {
+                fprintf(stderr, "lockdep: deadlock: thread %d waits for lock #%d, "
+                        "held by thread %d which exited without releasing it\n",
+                        self->tid, waiting->id, waiting->owner_tid);
+                abort();
+            }
+            return;
+        }
+        if (owner == self) {
+            fprintf(stderr, "lockdep: deadlock\n");
+            waiting = l;
+            do {
+                owner = (tcb_t *)waiting->owner;
+                fprintf(stderr, "  thread %d waits for lock #%d held by thread %d\n",
+                        self->tid, waiting->id, owner->tid);
+                self = owner;
+                waiting = self->cold.waiting_for;
+            } while (self != current_running);
+            abort();
+        }
+        waiting = owner->cold.waiting_for;
+    }
+}
+
+void lockdep_handoff(lock_t *l, void *tcb) {
+    // Owned by the waiter from now on, so that lockdep_wait() does not take
+    // the lock for one left behind by an exited thread until it runs
+    l->owner = tcb;
+    l->owner_tid = ((tcb_t *)tcb)->tid;
+}
+
+void lockdep_acquired(lock_t *l) {
+    tcb_t *self = current_running;
+
+    l->owner = self;
+    l->owner_tid = self->tid;
+    if (self->cold.num_held == LOCKDEP_MAX_HELD) {
+        fprintf(stderr, "lockdep: thread %d holds more than %d locks\n",
+                self->tid, LOCKDEP_MAX_HELD);
+        return;
+    }
+    self->cold.held_locks[self->cold.num_held++] = l;
+}
+
+void lockdep_release(lock_t *l) {
+    tcb_t *self = current_running;
+    int i;
+
+    if (l->owner != self) {
+        fprintf(stderr, "lockdep: thread %d releases lock #%d held by thread %d\n",
+                self->tid, l->id, l->owner_tid);
+    }
+    l->owner = NULL;
+
+    // Locks are not always released in reverse order
+    for (i = self->cold.num_held - 1; i >= 0; i--) {
+        if (self->cold.held_locks[i] == l) {
+            self->cold.num_held--;
+            for (; i < self->cold.num_held; i++) {
+                self->cold.held_locks[i] = self->cold.held_locks[i + 1];
+            }
+            break;
+        }
+    }
+}
+
+void lockdep_thread_exit(void) {
+    tcb_t *self = current_running;
+    int i;
+
+    // The TCB may be freed by thread_join(), so forget it as an owner and
+    // let lockdep_wait() report the lock through owner_tid
+    for (i = 0; i < self->cold.num_held; i++) {
+        fprintf(stderr, "lockdep: thread %d exits holding lock #%d\n",
+                self->tid, self->cold.held_locks[i]->id);
+        self->cold.held_locks[i]->owner = NULL;
+    }
+    self->cold.num_held = 0;
+}
+
+// The thread /t/ waits for, as owner of its lock or as the thread it
+// joins; NULL if only a thread_unblock() can wake it
+static tcb_t *waits_for(tcb_t *t) {
+    tcb_t *other;
+
+    if (t->thread_status != BLOCKED) {
+        return NULL;
+    }
+    if (t->cold.waiting_for != NULL) {
+        return (tcb_t *)t->cold.waiting_for->owner;
+    }
+    for (other = live_threads; other != NULL; other = other->cold.next_live) {
+        if (other->cold.joiner == t && other->thread_status != EXITED) {
+            return other;
+        }
+    }
+    return NULL;
+}
+
+void lockdep_no_ready_thread(void) {
+    tcb_t *start, *t, *next;
+    int i, hops, num_threads = 0;
+
+    for (t = live_threads; t != NULL; t = t->cold.next_live) {
+        num_threads++;
+    }
+
+    // Nothing can break a cycle of threads each waiting for the next one.
+    // Every such cycle goes through a lock, so start from lock waiters.
+    for (start = live_threads; start != NULL; start = start->cold.next_live) {
+        if (start->thread_status != BLOCKED || start->cold.waiting_for == NULL) {
+            continue;
+        }
+        // Nor can anything release a lock whose holder exited with it
+        // (lockdep_thread_exit() drops the owner but keeps owner_tid)
+        if (start->cold.waiting_for->status == LOCKED && start->cold.waiting_for->owner == NULL
+            && start->cold.waiting_for->owner_tid >= 0) {
+            fprintf(stderr, "lockdep: deadlock: no READY thread left\n"
+                    "  thread %d waits for lock #%d, held by thread %d which exited without releasing it\n",
+                    start->tid, start->cold.waiting_for->id, start->cold.waiting_for->owner_tid);
+            abort();
+        }
+        t = waits_for(start);
+        for (hops = 0; t != NULL && t != start && hops < num_threads; hops++) {
+            t = waits_for(t);
+        }
+        if (t != start) {
+            continue;
+        }
+
+        fprintf(stderr, "lockdep: deadlock: no READY thread left\n");
+        t = start;
+        do {
+            next = waits_for(t);
+            if (t->cold.waiting_for != NULL) {
+                fprintf(stderr, "  thread %d waits for lock #%d held by thread %d\n",
+                        t->tid, t->cold.waiting_for->id, next->tid);
+            } else {
+                fprintf(stderr, "  thread %d joins thread %d\n", t->tid, next->tid);
+            }
+            t = next;
+        } while (t != start);
+        for (i = 0; i < num_locks; i++) {
+            if (locks[i]->status == LOCKED) {
+                fprintf(stderr, "  lock #%d held by thread %d\n", i, locks[i]->owner_tid);
+            }
+        }
+        abort();
+    }
+}
+
+#endif                          /* LOCK_DEBUG */
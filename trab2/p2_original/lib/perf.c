@@ -0,0 +1,175 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <perf.h>
+
+__thread int perf_enabled;
+
+typedef struct {
+    int fd;                             // -1 when the kernel refused it
+    struct perf_event_mmap_page *page;  // For rdpmc, NULL if it cannot be mapped
+    int slot;                           // Position in a PERF_FORMAT_GROUP read
+} counter_t;
+
+static __thread counter_t counters[PERF_COUNTERS];
+static __thread int group_fd = -1;
+static __thread int group_size;
+static __thread uint64_t last[PERF_COUNTERS];
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} events[PERF_COUNTERS] = {
+    [PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERF_LLC_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+// Reads every counter with one read() of the group
+static void read_group(uint64_t values[PERF_COUNTERS]) {
+    uint64_t buf[1 + PERF_COUNTERS];
+    int i;
+
+    if (read(group_fd, buf, sizeof(uint64_t) * (1 + group_size)) <= 0) {
+        memcpy(values, last, sizeof(last));
+        return;
+    }
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        values[i] = counters[i].fd < 0 ? 0 : buf[1 + counters[i].slot];
+    }
+}
+
+// Reads one counter from user space, following the protocol documented in
+// linux/perf_event.h. Returns 0 if the counter is not on a PMC right now.
+static int read_pmc(struct perf_event_mmap_page *page, uint64_t *value) {
+    uint32_t seq, index;
+    uint64_t count;
+
+    do {
+        seq = page->lock;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        index = page->index;
+        if (!page->cap_user_rdpmc || index == 0) {
+            return 0;
+        }
+        count = __builtin_ia32_rdpmc(index - 1);
+        count <<= 64 - page->pmc_width;
+        count = (int64_t)count >> (64 - page->pmc_width);
+        count += page->offset;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    } while (page->lock != seq);
+
+    *value = count;
+    return 1;
+}
+
+static void read_counters(uint64_t values[PERF_COUNTERS]) {
+    int i;
+
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        if (counters[i].fd < 0) {
+            values[i] = 0;
+        } else if (counters[i].page == NULL || !read_pmc(counters[i].page, &values[i])) {
+            read_group(values);
+            return;
+        }
+    }
+}
+
+static void close_counters(void) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    int i;
+
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        if (counters[i].page != NULL) {
+            munmap(counters[i].page, page_size);
+            counters[i].page = NULL;
+        }
+        if (counters[i].fd >= 0) {
+            close(counters[i].fd);
+            counters[i].fd = -1;
+        }
+    }
+    group_fd = -1;
+}
+
+int perf_open(void) {
+    struct perf_event_attr attr;
+    int i, error = ENOENT;
+
+    if (perf_enabled) {
+        return 0;
+    }
+
+    group_fd = -1;
+    group_size = 0;
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.disabled = group_fd < 0;   // The leader starts the whole group
+
+        counters[i].fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+        counters[i].page = NULL;
+        if (counters[i].fd < 0) {
+            error = errno;
+            continue;
+        }
+        if (group_fd < 0) {
+            group_fd = counters[i].fd;
+        }
+        counters[i].slot = group_size++;
+
+        void *page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED,
+                          counters[i].fd, 0);
+        if (page != MAP_FAILED) {
+            counters[i].page = page;
+        }
+    }
+    if (group_fd < 0) {
+        return -error;
+    }
+
+    if (ioctl(group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) != 0) {
+        error = errno;
+        close_counters();
+        return -error;
+    }
+    read_counters(last);
+    perf_enabled = 1;
+    return 0;
+}
+
+int perf_available(int counter) {
+    return perf_enabled && counters[counter].fd >= 0;
+}
+
+void perf_account(uint64_t counts[PERF_COUNTERS]) {
+    uint64_t now[PERF_COUNTERS];
+    int i;
+
+    read_counters(now);
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        counts[i] += now[i] - last[i];
+        last[i] = now[i];
+    }
+}
+
+void perf_pending(uint64_t counts[PERF_COUNTERS]) {
+    uint64_t now[PERF_COUNTERS];
+    int i;
+
+    read_counters(now);
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        counts[i] += now[i] - last[i];
+    }
+}
@@ -11,30 +11,27 @@ node_t *dequeue(node_t **queue) {
   if (*queue == NULL) {
     return NULL;
   }
-  node_t *front = *queue;
-  *queue = front->next;
+  node_t *tail = *queue;
+  node_t *front = tail->next;
+  if (front == tail) {
+    *queue = NULL;
+  } else {
+    tail->next = front->next;
+  }
   front->next = NULL;
   return front;
 }
 
 void enqueue(node_t **queue, node_t *item) {
-  // char *status[] = {"FIRST_TIME", "READY", "BLOCKED", "EXITED"};
-
-  // printf("enqueue\n");
-
-  // tcb_t *tcb = (tcb_t *)(item->thread);
-  // printf("Thread ID: %d, Status: %s, CPU Time: %llu\n", tcb->tid, status[tcb->thread_status], (unsigned long long)tcb->cpu_time);
-  
-  item->next = NULL;
+  // The queue points at its tail and the tail points back at the front, so
+  // appending never walks the list
   if (*queue == NULL) {
-    *queue = item;
+    item->next = item;
   } else {
-    node_t *temp = *queue;
-    while (temp->next != NULL) {
-      temp = temp->next;
-    }
-    temp->next = item;
+    item->next = (*queue)->next;
+    (*queue)->next = item;
   }
+  *queue = item;
 }
 
 int is_empty(node_t *queue) {
@@ -42,7 +39,7 @@ int is_empty(node_t *queue) {
 }
 
 node_t *peek(node_t *queue) {
-  return queue;
+  return queue == NULL ? NULL : queue->next;
 }
 
 typedef int (*node_lte)(node_t *a, node_t *b);
@@ -61,15 +58,23 @@ typedef int (*node_lte)(node_t *a, node_t *b);
 // }
 
 void enqueue_sort(node_t **q, node_t *item, node_lte comp) {
-  if (*q == NULL || comp(item, *q)) {
-    item->next = *q;
+  if (*q == NULL) {
+    enqueue(q, item);
+    return;
+  }
+  node_t *tail = *q;
+  node_t *current = tail->next;
+  if (comp(item, current)) {
+    item->next = current;
+    tail->next = item;
+    return;
+  }
+  while (current != tail && comp(current->next, item)) {
+    current = current->next;
+  }
+  item->next = current->next;
+  current->next = item;
+  if (current == tail) {
     *q = item;
-  } else {
-    node_t *current = *q;
-    while (current->next != NULL && comp(current->next, item)) {
-      current = current->next;
-    }
-    item->next = current->next;
-    current->next = item;
   }
 }
@@ -0,0 +1,231 @@
+#include <errno.h>
+#include <arena.h>
+#include <queue.h>
+#include <task.h>
+#include <threadu.h>
+
+typedef struct task {
+    node_t node;                // Link in task_queue, node.thread is the task
+    void (*fn)(void *);
+    void *arg;
+    task_group_t *group;
+} task_t;
+
+typedef struct range {
+    long begin;
+    long end;
+    long grain;
+    void (*fn)(long, long, void *);
+    void *arg;
+    task_group_t *group;
+} range_t;
+
+static node_t *task_queue;
+static thread_t workers[TASK_MAX_WORKERS];
+static int num_workers = 0;
+static volatile int pool_stop;
+
+// Workers blocked for lack of tasks, the last to block on top. A worker
+// stays marked idle until a spawn takes it off the stack.
+static int idle_workers[TASK_MAX_WORKERS];
+static int num_idle = 0;
+static int worker_idle[TASK_MAX_WORKERS];
+
+static arena_chunk_t *task_chunks;
+static slab_t task_slab;
+static slab_t range_slab;
+static int slabs_ready = 0;
+
+// Pops and runs one queued task. Returns 0 if the queue was empty.
+static int run_one_task() {
+    node_t *node = dequeue(&task_queue);
+    if (node == NULL) {
+        return 0;
+    }
+
+    task_t *task = (task_t *)node->thread;
+    task_group_t *group = task->group;
+    task->fn(task->arg);
+    slab_free(&task_slab, task);
+
+    if (--group->pending == 0 && group->waiting) {
+        group->waiting = FALSE;
+        thread_unblock(&group->waiter);
+    }
+
+    return 1;
+}
+
+// Wakes the worker that blocked last, if any is idle
+static void wake_worker() {
+    if (num_idle > 0) {
+        int id = idle_workers[--num_idle];
+        worker_idle[id] = FALSE;
+        thread_unblock(&workers[id]);
+    }
+}
+
+static void *task_worker(void *arg) {
+    int id = (int)(long)arg;
+
+    while (!pool_stop || !is_empty(task_queue)) {
+        if (run_one_task()) {
+            continue;
+        }
+        if (!worker_idle[id]) {
+            worker_idle[id] = TRUE;
+            idle_workers[num_idle++] = id;
+        }
+        thread_block();
+    }
+    thread_exit(0);
+    return NULL;
+}
+
+int task_pool_init(int nworkers) {
+    int i;
+
+    if (num_workers > 0) {
+        return -EINVAL;
+    }
+    if (nworkers < 1 || nworkers > TASK_MAX_WORKERS) {
+        return -EINVAL;
+    }
+    if (!slabs_ready) {
+        slab_init(&task_slab, sizeof(task_t), sizeof(void *), &task_chunks);
+        slab_init(&range_slab, sizeof(range_t), sizeof(void *), &task_chunks);
+        queue_init(&task_queue);
+        slabs_ready = 1;
+    }
+
+    pool_stop = FALSE;
+    num_idle = 0;
+    for (i = 0; i < nworkers; i++) {
+        worker_idle[i] = FALSE;
+        if (thread_create(&workers[i], task_worker, (void *)(long)i) != 0) {
+            break;
+        }
+    }
+    num_workers = i;
+
+    return num_workers > 0 ? 0 : -ENOMEM;
+}
+
+void task_pool_shutdown() {
+    int i;
+
+    pool_stop = TRUE;
+    while (num_idle > 0) {
+        wake_worker();
+    }
+    for (i = 0; i < num_workers; i++) {
+        thread_join(&workers[i], NULL);
+    }
+    num_workers = 0;
+}
+
+void task_group_init(task_group_t *group) {
+    group->pending = 0;
+    group->waiting = FALSE;
+}
+
+int task_group_spawn(task_group_t *group, void (*fn)(void *), void *arg) {
+    if (num_workers == 0) {
+        int rv = task_pool_init(TASK_DEFAULT_WORKERS);
+        if (rv != 0) {
+            return rv;
+        }
+    }
+
+    task_t *task = (task_t *)slab_alloc(&task_slab);
+    if (task == NULL) {
+        return -ENOMEM;
+    }
+    task->node.thread = task;
+    task->fn = fn;
+    task->arg = arg;
+    task->group = group;
+
+    group->pending++;
+    enqueue(&task_queue, &task->node);
+    wake_worker();
+
+    return 0;
+}
+
+void task_group_wait(task_group_t *group) {
+    // Help instead of only blocking: the tasks we wait for may be queued
+    // behind the ones a waiting worker would otherwise never get to. Once
+    // the queue is empty the rest are running elsewhere, and the last to
+    // finish wakes us.
+    while (group->pending > 0) {
+        if (run_one_task()) {
+            continue;
+        }
+        group->waiter = thread_self();
+        group->waiting = TRUE;
+        thread_block();
+    }
+    group->waiting = FALSE;
+}
+
+// Splits off the upper half of the range as a new task until what is left
+// fits in a grain, then runs it
+static void run_range(void *arg) {
+    range_t *r = (range_t *)arg;
+
+    while (r->end - r->begin > r->grain) {
+        long mid = r->begin + (r->end - r->begin) / 2;
+        range_t *upper = (range_t *)slab_alloc(&range_slab);
+
+        if (upper == NULL) {
+            break;  // Out of memory: run the rest here, unsplit
+        }
+        *upper = *r;
+        upper->begin = mid;
+        if (task_group_spawn(r->group, run_range, upper) != 0) {
+            slab_free(&range_slab, upper);
+            break;
+        }
+        r->end = mid;
+    }
+    r->fn(r->begin, r->end, r->arg);
+    slab_free(&range_slab, r);
+}
+
+int parallel_for(long begin, long end, long grain,
+                 void (*fn)(long begin, long end, void *arg), void *arg) {
+    task_group_t group;
+    range_t *r;
+    int rv;
+
+    if (begin >= end) {
+        return 0;
+    }
+    if (grain < 1) {
+        grain = 1;
+    }
+    if (num_workers == 0 && (rv = task_pool_init(TASK_DEFAULT_WORKERS)) != 0) {
+        return rv;
+    }
+
+    r = (range_t *)slab_alloc(&range_slab);
+    if (r == NULL) {
+        return -ENOMEM;
+    }
+    r->begin = begin;
+    r->end = end;
+    r->grain = grain;
+    r->fn = fn;
+    r->arg = arg;
+
+    task_group_init(&group);
+    r->group = &group;
+    if ((rv = task_group_spawn(&group, run_range, r)) != 0) {
+        slab_free(&range_slab, r);
+        return rv;
+    }
+    task_group_wait(&group);
+
+    return 0;
+}
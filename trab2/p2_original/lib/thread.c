@@ -1,15 +1,163 @@
 #include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <arena.h>
+#include <lockdep.h>
+#include <perf.h>
 #include <queue.h>
 #include <thread.h>
+#include <topology.h>
+#include <util.h>
+
+// entry.S addresses the TCB through these constants
+_Static_assert(offsetof(tcb_t, stack_pointer) == TCB_STACK_POINTER,
+               "TCB_STACK_POINTER does not match tcb_t");
+_Static_assert(offsetof(tcb_t, cold) == CACHE_LINE_SIZE,
+               "hot TCB fields must fit in the first cache line");
+_Static_assert(CONTEXT_SIZE % 16 == 0,
+               "scheduler_entry assumes an even number of saved registers");
 
 node_t *ready_queue;
 tcb_t *current_running;
+tcb_t *live_threads;
+
+// Threads with a deadline: released ones by deadline, the others by release
+static node_t *deadline_queue;
+static node_t *sleep_queue;
+
+// Threads woken by thread_unblock(), which may run on another OS thread or
+// in a signal handler, until the worker moves them to the ready queues. The
+// worker parks on wake_seq when nothing is ready, and every wakeup bumps it.
+static _Atomic(tcb_t *) wake_list;
+static atomic_uint wake_seq;
+static atomic_int worker_parked;
+static int blocked_threads;
+
+// get_timer() ticks per millisecond, measured the first time a deadline is set
+static uint64_t ticks_per_ms;
+
+#ifdef THREAD_STATIC
+
+// Everything a thread needs, by slot; a thread's ID is its slot
+static tcb_t tcb_table[THREAD_MAX_THREADS];
+static char stack_table[THREAD_MAX_THREADS][STACK_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+static char arena_table[THREAD_MAX_THREADS][THREAD_ARENA_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+static arena_chunk_t *arena_cache[THREAD_MAX_THREADS];
+static int free_slots[THREAD_MAX_THREADS];
+static int num_free_slots;
+
+// stdio would allocate its buffer on first use
+#define say(...) do {                                                   \
+        char line_[80];                                                 \
+        int n_ = snprintf(line_, sizeof(line_), __VA_ARGS__);           \
+        if (write(STDOUT_FILENO, line_, n_) < 0) {                      \
+        }                                                               \
+    } while (0)
+
+static void heap_init(void) {
+    int i;
+
+    num_free_slots = 0;
+    for (i = THREAD_MAX_THREADS - 1; i >= 0; i--) {
+        free_slots[num_free_slots++] = i;
+        arena_cache[i] = NULL;
+        if (THREAD_ARENA_SIZE > sizeof(arena_chunk_t)) {
+            arena_cache[i] = (arena_chunk_t *)arena_table[i];
+            arena_cache[i]->next = NULL;
+            arena_cache[i]->end = arena_table[i] + THREAD_ARENA_SIZE;
+        }
+    }
+}
+
+static tcb_t *alloc_tcb(int with_stack) {
+    if (num_free_slots == 0) {
+        return NULL;
+    }
+    int slot = free_slots[--num_free_slots];
+    tcb_t *tcb = &tcb_table[slot];
+
+    tcb->tid = slot;
+    tcb->cold.stack = with_stack ? stack_table[slot] : NULL;
+    arena_init(&tcb->cold.arena, &arena_cache[slot]);
+    return tcb;
+}
+
+static void free_tcb(tcb_t *tcb) {
+    free_slots[num_free_slots++] = tcb->tid;
+}
+
+#else
+
+#define say printf
 
 int tid_global = 0;
 
+// TCBs and stacks come from the worker's slabs instead of malloc
+static __thread worker_heap_t worker_heap;
+
+static void heap_init(void) {
+    worker_heap_t *heap = &worker_heap;
+
+    heap->chunk_cache = NULL;
+    slab_init(&heap->tcb_slab, sizeof(tcb_t), CACHE_LINE_SIZE, &heap->chunk_cache);
+    slab_init(&heap->stack_slab, STACK_SIZE, CACHE_LINE_SIZE, &heap->chunk_cache);
+}
+
+static tcb_t *alloc_tcb(int with_stack) {
+    tcb_t *tcb = (tcb_t *)slab_alloc(&worker_heap.tcb_slab);
+    if (tcb == NULL) {
+        return NULL;
+    }
+
+    tcb->cold.stack = NULL;
+    if (with_stack && (tcb->cold.stack = slab_alloc(&worker_heap.stack_slab)) == NULL) {
+        slab_free(&worker_heap.tcb_slab, tcb);
+        return NULL;
+    }
+    tcb->tid = tid_global++;
+    arena_init(&tcb->cold.arena, &worker_heap.chunk_cache);
+    return tcb;
+}
+
+static void free_tcb(tcb_t *tcb) {
+    slab_free(&worker_heap.stack_slab, tcb->cold.stack);
+    slab_free(&worker_heap.tcb_slab, tcb);
+}
+
+#endif                          /* THREAD_STATIC */
+
+// The fence keeps the compiler from publishing the TCB before its links are
+// set, in case thread_dump() runs from a signal handler in between
+static void register_thread(tcb_t *tcb) {
+    tcb->cold.prev_live = NULL;
+    tcb->cold.next_live = live_threads;
+    if (live_threads != NULL) {
+        live_threads->cold.prev_live = tcb;
+    }
+    atomic_signal_fence(memory_order_seq_cst);
+    live_threads = tcb;
+}
+
+static void unregister_thread(tcb_t *tcb) {
+    if (tcb->cold.prev_live != NULL) {
+        tcb->cold.prev_live->cold.next_live = tcb->cold.next_live;
+    } else {
+        live_threads = tcb->cold.next_live;
+    }
+    atomic_signal_fence(memory_order_seq_cst);
+    if (tcb->cold.next_live != NULL) {
+        tcb->cold.next_live->cold.prev_live = tcb->cold.prev_live;
+    }
+}
+
 void debug_print_current_running() {
     char *status[] = {"FIRST_TIME", "READY", "BLOCKED", "EXITED"};
     if (current_running != NULL) {
@@ -23,73 +171,388 @@ void debug_print_current_running() {
 }
 
 int thread_init() {
+#ifndef THREAD_STATIC
+    const char *cpus = getenv("THREADU_CPUS");
+#endif
+
     if (ready_queue != NULL) {
         return -EINVAL;  // Already initialized
     }
 
+#ifndef THREAD_STATIC
+    // Pin first, so the worker's slabs are allocated on its own node. The
+    // static build leaves it out: reading the topology uses the heap.
+    if (cpus != NULL && *cpus != '\0') {
+        int rv = worker_pin(cpus);
+        if (rv != 0) {
+            return rv;
+        }
+    }
+#endif
+
     queue_init(&ready_queue);
+    queue_init(&deadline_queue);
+    queue_init(&sleep_queue);
+    heap_init();
 
     // Initialize main thread
-    current_running = (tcb_t *)malloc(sizeof(tcb_t));
+    current_running = alloc_tcb(FALSE);
     if (current_running == NULL) {
         return -ENOMEM;
     }
 
-    current_running->tid = tid_global++;
     current_running->stack_pointer = NULL;
-    current_running->start_routine = NULL;
-    current_running->arg = NULL;
-    current_running->exit_status = 0;
+    current_running->cold.start_routine = NULL;
+    current_running->cold.arg = NULL;
+    current_running->cold.exit_status = 0;
     current_running->thread_status = READY;
     current_running->cpu_time = 0;
-    current_running->next = NULL;
+    current_running->last_run = get_timer();
+    current_running->deadline = 0;
+    current_running->release = 0;
+    current_running->cold.period = 0;
+    current_running->cold.deadline_misses = 0;
+    current_running->cold.joiner = NULL;
+    atomic_init(&current_running->cold.wake_permit, 0);
+    atomic_init(&current_running->cold.wake_queued, 0);
+    current_running->cold.wake_next = NULL;
+    current_running->cold.waiting_for = NULL;
+    memset(current_running->cold.perf, 0, sizeof(current_running->cold.perf));
+    current_running->stack_low = NULL;  // The process stack is not ours to measure
+#ifdef LOCK_DEBUG
+    current_running->cold.num_held = 0;
+#endif
+    register_thread(current_running);
+
+    const char *perf = getenv("THREADU_PERF");
+    if (perf != NULL && strcmp(perf, "1") == 0) {
+        thread_perf_enable();
+    }
+
+    // SIGUSR1 dumps every thread, unless the program wants it for itself
+    struct sigaction usr1;
+    if (sigaction(SIGUSR1, NULL, &usr1) == 0 && usr1.sa_handler == SIG_DFL) {
+        const char *format = getenv("THREADU_DUMP");
+        thread_dump_on_signal(SIGUSR1, format != NULL && strcmp(format, "json") == 0);
+    }
 
     return 0;
 }
 
-int thread_create(thread_t *thread, void *(*start_routine)(void *), void *arg) {
-    tcb_t *new_tcb = (tcb_t *)malloc(sizeof(tcb_t));
+// First code run by a new thread: RESTORE_CONTEXT returns here
+static void thread_start() {
+    current_running->cold.start_routine(current_running->cold.arg);
+    exit_handler();  // If the start routine returns, exit the thread
+}
+
+// Creates a thread with /reserve/ bytes set aside at the top of its stack.
+// With a reserve, /arg/ is ignored and the thread gets the reserved bytes.
+static int create_thread(thread_t *thread, void *(*start_routine)(void *), void *arg,
+                         size_t reserve) {
+    tcb_t *new_tcb = alloc_tcb(TRUE);
     if (new_tcb == NULL) {
         return -ENOMEM;
     }
 
-    new_tcb->tid = tid_global++;
-    new_tcb->stack_pointer = (uint64_t *)malloc(STACK_SIZE);
-    if (new_tcb->stack_pointer == NULL) {
-        free(new_tcb);
-        return -ENOMEM;
+    // Build the frame RESTORE_CONTEXT expects: flags, the registers and the
+    // return address of scheduler_entry, which starts the thread. The extra
+    // slot keeps the stack aligned as if thread_start had been called.
+    uint64_t *sp = (uint64_t *)((char *)new_tcb->cold.stack + STACK_SIZE - reserve);
+    if (reserve > 0) {
+        arg = sp;
     }
-    new_tcb->start_routine = start_routine;
-    new_tcb->arg = arg;
-    new_tcb->exit_status = 0;
+    *--sp = 0;
+    *--sp = (uint64_t)thread_start;
+    sp = (uint64_t *)((char *)sp - CONTEXT_SIZE);
+    memset(sp, 0, CONTEXT_SIZE);
+    sp[0] = 0x202;  // flags: IF and the reserved bit
+
+    new_tcb->stack_pointer = sp;
+    new_tcb->cold.start_routine = start_routine;
+    new_tcb->cold.arg = arg;
+    new_tcb->cold.exit_status = 0;
     new_tcb->thread_status = FIRST_TIME;
     new_tcb->cpu_time = 0;
-    new_tcb->next = NULL;
+    new_tcb->last_run = 0;
+    new_tcb->deadline = 0;
+    new_tcb->release = 0;
+    new_tcb->cold.period = 0;
+    new_tcb->cold.deadline_misses = 0;
+    new_tcb->cold.joiner = NULL;
+    atomic_init(&new_tcb->cold.wake_permit, 0);
+    atomic_init(&new_tcb->cold.wake_queued, 0);
+    new_tcb->cold.wake_next = NULL;
+    new_tcb->cold.waiting_for = NULL;
+    memset(new_tcb->cold.perf, 0, sizeof(new_tcb->cold.perf));
+    new_tcb->stack_low = sp;
+#ifdef LOCK_DEBUG
+    new_tcb->cold.num_held = 0;
+#endif
 
     thread->tcb = new_tcb;
 
     // Add the new thread to the ready queue
-    node_t *new_node = (node_t *)malloc(sizeof(node_t));
-    if (new_node == NULL) {
-        free(new_tcb->stack_pointer);
-        free(new_tcb);
-        return -ENOMEM;
+    new_tcb->cold.run_node.thread = new_tcb;
+    enqueue(&ready_queue, &new_tcb->cold.run_node);
+    register_thread(new_tcb);
+
+    return 0;
+}
+
+int thread_create(thread_t *thread, void *(*start_routine)(void *), void *arg) {
+    return create_thread(thread, start_routine, arg, 0);
+}
+
+int thread_create_inline(thread_t *thread, void *(*start_routine)(void *), size_t size,
+                         void **arg) {
+    // Keep the reserve 16-byte aligned, and most of the stack for the thread
+    size_t reserve = (size + 15) & ~(size_t)15;
+    int ret;
+
+    if (size == 0 || reserve > STACK_SIZE / 4) {
+        return -EINVAL;
+    }
+    ret = create_thread(thread, start_routine, NULL, reserve);
+    if (ret == 0) {
+        *arg = ((tcb_t *)thread->tcb)->cold.arg;
     }
+    return ret;
+}
+
+static int deadline_lte(node_t *a, node_t *b) {
+    return ((tcb_t *)a->thread)->deadline <= ((tcb_t *)b->thread)->deadline;
+}
+
+static int release_lte(node_t *a, node_t *b) {
+    return ((tcb_t *)a->thread)->release <= ((tcb_t *)b->thread)->release;
+}
 
-    new_node->thread = new_tcb;
-    new_node->next = NULL;
-    enqueue(&ready_queue, new_node);
+// Queues a READY thread where the scheduler will look for it
+static void make_ready(tcb_t *thread) {
+    node_t *node = &thread->cold.run_node;
 
+    node->thread = thread;
+    if (thread->deadline == 0) {
+        enqueue(&ready_queue, node);
+    } else if (thread->release > get_timer()) {
+        enqueue_sort(&sleep_queue, node, release_lte);
+    } else {
+        enqueue_sort(&deadline_queue, node, deadline_lte);
+    }
+}
+
+// Moves the sleeping threads whose next job has been released
+static void release_threads(uint64_t now) {
+    while (!is_empty(sleep_queue) &&
+           ((tcb_t *)peek(sleep_queue)->thread)->release <= now) {
+        enqueue_sort(&deadline_queue, dequeue(&sleep_queue), deadline_lte);
+    }
+}
+
+static void calibrate_timer(void) {
+    struct timespec t0, t1, pause = {0, 2000000};
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t start = get_timer();
+    nanosleep(&pause, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    uint64_t ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+    ticks_per_ms = (get_timer() - start) * 1000000 / ns;
+    if (ticks_per_ms == 0) {
+        ticks_per_ms = 1;
+    }
+}
+
+static uint64_t usec_to_ticks(unsigned long usec) {
+    if (ticks_per_ms == 0) {
+        calibrate_timer();
+    }
+    return (uint64_t)usec * ticks_per_ms / 1000;
+}
+
+// Nothing can run: parks the worker until a wakeup is posted or, if /until/
+// is not 0, until get_timer() reaches it
+static void park(uint64_t until) {
+    unsigned int seq = atomic_load(&wake_seq);
+    struct timespec timeout, *t = NULL;
+
+    if (until != 0) {
+        uint64_t now = get_timer();
+        if (until <= now) {
+            return;
+        }
+        uint64_t ns = (until - now) * 1000000 / ticks_per_ms;
+        timeout.tv_sec = ns / 1000000000;
+        timeout.tv_nsec = ns % 1000000000;
+        t = &timeout;
+    }
+
+    // A waker pushes, then bumps wake_seq, then looks at worker_parked: it
+    // either sees us parked or we see its push, and a bump between the two
+    // makes FUTEX_WAIT return at once
+    atomic_store(&worker_parked, 1);
+    if (atomic_load(&wake_list) == NULL) {
+        syscall(SYS_futex, &wake_seq, FUTEX_WAIT_PRIVATE, seq, t, NULL, 0);
+    }
+    atomic_store(&worker_parked, 0);
+}
+
+static void post_wakeup(tcb_t *thread) {
+    atomic_store(&thread->cold.wake_permit, 1);
+    if (atomic_exchange(&thread->cold.wake_queued, 1) != 0) {
+        return;  // Already on the list: the worker will see the permit
+    }
+
+    tcb_t *head = atomic_load(&wake_list);
+    do {
+        thread->cold.wake_next = head;
+    } while (!atomic_compare_exchange_weak(&wake_list, &head, thread));
+
+    atomic_fetch_add(&wake_seq, 1);
+    if (atomic_load(&worker_parked)) {
+        syscall(SYS_futex, &wake_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+// Readies the blocked threads on the wakeup list, in the order they were woken
+static void drain_wakeups(void) {
+    tcb_t *thread, *fifo = NULL;
+
+    // A plain load first keeps the common, empty case off the bus
+    if (atomic_load_explicit(&wake_list, memory_order_relaxed) == NULL) {
+        return;
+    }
+    thread = atomic_exchange(&wake_list, NULL);
+
+    while (thread != NULL) {
+        tcb_t *next = thread->cold.wake_next;
+        thread->cold.wake_next = fifo;
+        fifo = thread;
+        thread = next;
+    }
+    while (fifo != NULL) {
+        tcb_t *next = fifo->cold.wake_next;
+        atomic_store(&fifo->cold.wake_queued, 0);
+        // A thread that has not blocked yet keeps its permit
+        if (fifo->thread_status == BLOCKED &&
+            atomic_exchange(&fifo->cold.wake_permit, 0) != 0) {
+            fifo->thread_status = READY;
+            blocked_threads--;
+            make_ready(fifo);
+        }
+        fifo = next;
+    }
+}
+
+thread_t thread_self(void) {
+    thread_t self = {current_running};
+    return self;
+}
+
+void thread_block(void) {
+    if (atomic_exchange(&current_running->cold.wake_permit, 0) != 0) {
+        return;
+    }
+    current_running->thread_status = BLOCKED;
+    blocked_threads++;
+    scheduler_entry();
+}
+
+void thread_unblock(thread_t *thread) {
+    post_wakeup((tcb_t *)thread->tcb);
+}
+
+// The job of the running thread is over: count it if it ended late
+static void end_job(tcb_t *thread, uint64_t now) {
+    if (thread->deadline != 0 && now > thread->deadline) {
+        thread->cold.deadline_misses++;
+    }
+}
+
+int thread_set_period(unsigned long period_us) {
+    uint64_t now = get_timer();
+
+    end_job(current_running, now);
+    current_running->cold.period = period_us == 0 ? 0 : usec_to_ticks(period_us);
+    current_running->release = now;
+    current_running->deadline = period_us == 0 ? 0 : now + current_running->cold.period;
+    return 0;
+}
+
+int thread_set_deadline(unsigned long deadline_us) {
+    uint64_t now = get_timer();
+
+    end_job(current_running, now);
+    current_running->cold.period = 0;
+    current_running->release = now;
+    current_running->deadline = deadline_us == 0 ? 0 : now + usec_to_ticks(deadline_us);
     return 0;
 }
 
+void thread_wait_period(void) {
+    tcb_t *thread = current_running;
+    uint64_t period = thread->cold.period;
+    uint64_t now = get_timer();
+
+    if (period != 0) {
+        // Skip the releases this job overran, counting each as a miss
+        if (now > thread->deadline) {
+            uint64_t late = (now - thread->deadline) / period + 1;
+            thread->cold.deadline_misses += late;
+            thread->deadline += late * period;
+        }
+        thread->release = thread->deadline;
+        thread->deadline += period;
+    }
+    thread_yield();
+}
+
+int thread_perf_enable(void) {
+    int rv = perf_open();
+
+    // Counting starts now; what ran before is charged to nobody
+    if (rv == 0) {
+        memset(current_running->cold.perf, 0, sizeof(current_running->cold.perf));
+    }
+    return rv;
+}
+
+void thread_stats(thread_t *thread, thread_stats_t *stats) {
+    tcb_t *tcb = thread == NULL ? current_running : (tcb_t *)thread->tcb;
+    uint64_t counts[PERF_COUNTERS];
+    int64_t *fields[PERF_COUNTERS] = {
+        [PERF_INSTRUCTIONS] = &stats->instructions,
+        [PERF_CYCLES] = &stats->cycles,
+        [PERF_LLC_MISSES] = &stats->llc_misses,
+        [PERF_BRANCH_MISSES] = &stats->branch_misses,
+    };
+    int i;
+
+    stats->cpu_time = tcb->cpu_time;
+    stats->deadline_misses = tcb->cold.deadline_misses;
+    memcpy(counts, tcb->cold.perf, sizeof(counts));
+    // The running thread is only charged at its next switch
+    if (tcb == current_running) {
+        stats->cpu_time += get_timer() - tcb->last_run;
+        if (perf_enabled) {
+            perf_pending(counts);
+        }
+    }
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        *fields[i] = perf_available(i) ? (int64_t)counts[i] : -1;
+    }
+}
+
+unsigned long thread_deadline_misses(thread_t *thread) {
+    tcb_t *tcb = thread == NULL ? current_running : (tcb_t *)thread->tcb;
+    return tcb->cold.deadline_misses;
+}
+
 int thread_yield() {
 	// print_queue(ready_queue);
     // Add the current thread to the ready queue if it's still ready
     if (current_running->thread_status == READY) {
-        node_t *node = (node_t *)malloc(sizeof(node_t));
-        node->thread = current_running;
-        enqueue(&ready_queue, node);
+        make_ready(current_running);
     }
 
     // Call the scheduler to select the next thread
@@ -98,60 +561,116 @@ int thread_yield() {
     return 0;
 }
 
-int thread_join(thread_t *thread, int *retval) {
+int thread_wait(thread_t *thread) {
     tcb_t *tcb = (tcb_t *)(thread->tcb);
 
-    while (tcb->thread_status != EXITED) {
-        thread_yield();
+    if (tcb->thread_status != EXITED) {
+        tcb->cold.joiner = current_running;
+        while (tcb->thread_status != EXITED) {
+            thread_block();
+        }
     }
+    return 0;
+}
+
+int thread_join(thread_t *thread, int *retval) {
+    tcb_t *tcb = (tcb_t *)(thread->tcb);
+
+    thread_wait(thread);
 
     if (retval != NULL) {
-        *retval = tcb->exit_status;
+        *retval = tcb->cold.exit_status;
     }
 
-    free(tcb->stack_pointer);
-    free(tcb);
+    unregister_thread(tcb);
+    free_tcb(tcb);
 
     return 0;
 }
 
+void *thread_alloc(size_t size) {
+    return arena_alloc(&current_running->cold.arena, size, sizeof(void *) * 2);
+}
+
 void thread_exit(int status) {
-    current_running->exit_status = status;
+    lockdep_thread_exit();
+
+    // Everything the thread got from thread_alloc() goes back in one splice
+    arena_release(&current_running->cold.arena);
+
+    end_job(current_running, get_timer());
+    current_running->cold.exit_status = status;
     current_running->thread_status = EXITED;
+    // The joiner is on this worker: ready it directly, without the atomics
+    // thread_unblock() needs
+    tcb_t *joiner = current_running->cold.joiner;
+    if (joiner != NULL && joiner->thread_status == BLOCKED) {
+        joiner->thread_status = READY;
+        blocked_threads--;
+        make_ready(joiner);
+    }
 
     // Call the scheduler to select the next thread
     scheduler_entry();
 }
 
 void scheduler() {
+    uint64_t now = get_timer();
+
+#ifdef DEBUG
     printf("Before scheduling:\n");
     debug_print_current_running();
+#endif
 
-    if (is_empty(ready_queue)) {
-        printf("No more threads to schedule.\n");
-        exit_handler();
-        return;
+    current_running->cpu_time += now - current_running->last_run;
+    if (current_running->stack_pointer < current_running->stack_low) {
+        current_running->stack_low = current_running->stack_pointer;
+    }
+    if (perf_enabled) {
+        perf_account(current_running->cold.perf);
     }
 
-    // Dequeue the next thread to run
-    node_t *next_node = dequeue(&ready_queue);
+    drain_wakeups();
+    release_threads(now);
+    while (is_empty(deadline_queue) && is_empty(ready_queue)) {
+        if (is_empty(sleep_queue) && blocked_threads == 0) {
+            // Every thread has exited, the running one last
+            say("No more threads to schedule.\n");
+            exit(current_running->cold.exit_status);
+        }
+        // Only a thread_unblock() or the first sleeper can bring work now
+        if (is_empty(sleep_queue)) {
+            lockdep_no_ready_thread();
+            park(0);
+        } else {
+            park(((tcb_t *)peek(sleep_queue)->thread)->release);
+        }
+        drain_wakeups();
+        now = get_timer();
+        release_threads(now);
+    }
+
+    // The nearest deadline goes first, then the FIFO threads
+    node_t *next_node = !is_empty(deadline_queue) ? dequeue(&deadline_queue)
+                                                  : dequeue(&ready_queue);
     tcb_t *next_thread = (tcb_t *)(next_node->thread);
-    free(next_node);
     // printf("Next thread:\n Thread ID: %d, Status: %s, CPU Time: %llu\n", next_thread->tid, status[next_thread->thread_status], (unsigned long long)next_thread->cpu_time);
 
     current_running = next_thread;
+    current_running->last_run = now;
 
-    // If the thread is running for the first time, call its start routine
+    // A new thread starts in thread_start() once its context is restored
     if (next_thread->thread_status == FIRST_TIME) {
         next_thread->thread_status = READY;
-        next_thread->start_routine(next_thread->arg); //shit's happening here...
-        printf("After scheduling:\n");
-        debug_print_current_running();
-        exit_handler();  // If the start routine returns, exit the thread
     }
+
+#ifdef DEBUG
+    printf("After scheduling:\n");
+    debug_print_current_running();
+#endif
 }
 
 void exit_handler() {
-    printf("Thread %d has exited\n", current_running->tid);
+    say("Thread %d has exited\n", current_running->tid);
     thread_exit(-1);
 }
@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <topology.h>
+
+#define NODE_DIR	"/sys/devices/system/node"
+
+static topology_t system_topology;
+static int topology_loaded = 0;
+
+static __thread int home_node = -1;
+
+// Adds the CPUs of /list/ ("0-3,8") to the node, up to the first ';' or the
+// end of the string. Returns the number of CPUs read, or -EINVAL.
+static int parse_cpulist(topology_t *t, const char *list, int node) {
+    const char *p = list;
+    int count = 0;
+
+    while (*p != '\0' && *p != ';' && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10), last;
+
+        if (end == p || first < 0) {
+            return -EINVAL;
+        }
+        last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) {
+                return -EINVAL;
+            }
+            p = end;
+        }
+        if (last >= TOPOLOGY_MAX_CPUS) {
+            return -EINVAL;
+        }
+        for (; first <= last; first++, count++) {
+            t->cpu_node[first] = node;
+            if (first >= t->num_cpus) {
+                t->num_cpus = first + 1;
+            }
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0' && *p != ';' && *p != '\n') {
+            return -EINVAL;
+        }
+    }
+
+    return count;
+}
+
+static int load_override(topology_t *t, const char *spec) {
+    const char *p = spec;
+
+    t->synthetic = 1;
+    while (1) {
+        if (t->num_nodes == TOPOLOGY_MAX_NODES ||
+            parse_cpulist(t, p, t->num_nodes) <= 0) {
+            return -EINVAL;
+        }
+        t->num_nodes++;
+        p = strchr(p, ';');
+        if (p == NULL || *++p == '\0') {
+            return 0;
+        }
+    }
+}
+
+static void load_sysfs(topology_t *t) {
+    DIR *dir = opendir(NODE_DIR);
+    struct dirent *entry;
+
+    if (dir == NULL) {
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        char path[320], list[4096];
+        FILE *f;
+        int node;
+
+        if (strncmp(entry->d_name, "node", 4) != 0 || !isdigit(entry->d_name[4])) {
+            continue;
+        }
+        node = atoi(entry->d_name + 4);
+        if (node >= TOPOLOGY_MAX_NODES) {
+            continue;
+        }
+        snprintf(path, sizeof(path), NODE_DIR "/%s/cpulist", entry->d_name);
+        if ((f = fopen(path, "r")) == NULL) {
+            continue;
+        }
+        if (fgets(list, sizeof(list), f) != NULL && parse_cpulist(t, list, node) >= 0 &&
+            node >= t->num_nodes) {
+            t->num_nodes = node + 1;
+        }
+        fclose(f);
+    }
+    closedir(dir);
+}
+
+int topology_load(topology_t *t) {
+    const char *spec = getenv("THREADU_TOPOLOGY");
+    int i;
+
+    t->num_nodes = 0;
+    t->num_cpus = 0;
+    t->synthetic = 0;
+    for (i = 0; i < TOPOLOGY_MAX_CPUS; i++) {
+        t->cpu_node[i] = -1;
+    }
+
+    if (spec != NULL && *spec != '\0') {
+        return load_override(t, spec);
+    }
+
+    load_sysfs(t);
+    if (t->num_nodes == 0) {
+        long n = sysconf(_SC_NPROCESSORS_CONF);
+
+        t->num_nodes = 1;
+        t->num_cpus = n < 1 ? 1 : n > TOPOLOGY_MAX_CPUS ? TOPOLOGY_MAX_CPUS : n;
+        for (i = 0; i < t->num_cpus; i++) {
+            t->cpu_node[i] = 0;
+        }
+    }
+
+    return 0;
+}
+
+const topology_t *topology(void) {
+    if (!topology_loaded) {
+        if (topology_load(&system_topology) != 0) {
+            fprintf(stderr, "topology: ignoring malformed THREADU_TOPOLOGY\n");
+            unsetenv("THREADU_TOPOLOGY");
+            topology_load(&system_topology);
+        }
+        topology_loaded = 1;
+    }
+    return &system_topology;
+}
+
+// sched_setaffinity() on pid 0 pins the calling thread only
+static int pin(cpu_set_t *set, int node) {
+    if (sched_setaffinity(0, sizeof(cpu_set_t), set) != 0) {
+        return -errno;
+    }
+    home_node = node;
+    return 0;
+}
+
+int worker_pin(const char *cpus) {
+    const topology_t *t = topology();
+    topology_t parsed;
+    cpu_set_t set;
+    int i, node = -1;
+
+    parsed.num_cpus = 0;
+    for (i = 0; i < TOPOLOGY_MAX_CPUS; i++) {
+        parsed.cpu_node[i] = -1;
+    }
+    // Parsed as a one-node topology to reuse the CPU list reader
+    if (parse_cpulist(&parsed, cpus, 0) <= 0) {
+        return -EINVAL;
+    }
+
+    CPU_ZERO(&set);
+    for (i = 0; i < parsed.num_cpus; i++) {
+        if (parsed.cpu_node[i] == 0) {
+            CPU_SET(i, &set);
+            if (node < 0 && i < t->num_cpus) {
+                node = t->cpu_node[i];
+            }
+        }
+    }
+
+    return pin(&set, node);
+}
+
+int worker_pin_node(int node) {
+    const topology_t *t = topology();
+    cpu_set_t set;
+    int i;
+
+    if (node < 0 || node >= t->num_nodes) {
+        return -EINVAL;
+    }
+    CPU_ZERO(&set);
+    for (i = 0; i < t->num_cpus; i++) {
+        if (t->cpu_node[i] == node) {
+            CPU_SET(i, &set);
+        }
+    }
+
+    return pin(&set, node);
+}
+
+int worker_node(void) {
+    return home_node;
+}
+
+void worker_bind_memory(void *addr, size_t len) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)addr + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)addr + len) & ~(page - 1);
+    unsigned long mask[TOPOLOGY_MAX_NODES / (8 * sizeof(unsigned long)) + 1] = {0};
+
+    if (home_node < 0 || topology()->synthetic || end <= start) {
+        return;
+    }
+    // Preferred rather than bound: a full node still falls back to another
+    mask[home_node / (8 * sizeof(unsigned long))] = 1UL << (home_node % (8 * sizeof(unsigned long)));
+    syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, mask,
+            sizeof(mask) * 8, 0);
+}